@@ -29,6 +29,8 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -36,111 +38,368 @@
 
 #include "cache.h"
 
+/* An open addressing hash table with linear probing. The table only holds
+ * pointers to the entries. The entries, with the key stored inline after
+ * the value, are carved out of arena blocks and never move, so the slot
+ * returned by ox_cache_get() stays valid even if the table grows before the
+ * caller sets the slot.
+ *
+ * A cache with a limit evicts an entry for each new one once it is full. A
+ * CLOCK hand sweeps the table, clearing the ref flag that a hit sets and
+ * evicting the first entry it finds without one. Evicted entries go on a
+ * free list for their size and are reused for later keys of that size.
+ * Entries that have not been given a value yet are never evicted since the
+ * caller still holds the slot.
+ */
+
+#define CACHE_MIN_SIZE	64
+#define ARENA_MIN	1024
+#define ARENA_MAX	16384
+#define FREE_MAX	256	// larger entries are allocated on their own
+
+typedef struct _Entry {
+    VALUE	value;	// next free entry when on a free list
+    uint32_t	hash;
+    uint32_t	len;
+    char	ref;
+    char	key[1];
+} *Entry;
+
+typedef struct _Arena {
+    struct _Arena	*next;
+    size_t		size;
+    size_t		used;
+    char		buf[1];
+} *Arena;
+
 struct _Cache {
-    char                *key; // only set if the node has a value, and it is not an exact match
-    VALUE               value;
-    struct _Cache       *slots[16];
+    Entry		*table;
+    unsigned long	mask;	// table size - 1
+    unsigned long	cnt;
+    unsigned long	limit;	// 0 for no limit
+    unsigned long	hand;
+    unsigned long	hits;
+    unsigned long	misses;
+    unsigned long	evictions;
+    unsigned long	big_bytes;
+    Arena		arena;
+    Entry		free[FREE_MAX / 8 + 1];
 };
 
-static void     slot_print(Cache cache, unsigned int depth);
+static Entry	entry_new(Cache cache, const char *key, size_t len, uint32_t hash);
+static void	entry_free(Cache cache, Entry e);
+static void	grow(Cache cache);
+static void	evict(Cache cache);
+
+inline static size_t
+entry_size(size_t len) {
+    return (offsetof(struct _Entry, key) + len + 1 + 7) & ~(size_t)7;
+}
+
+// Compares 8 bytes at a time, names are too short for memcmp() to pay off.
+inline static int
+key_eq(const char *key, const char *ek, size_t len) {
+    uint64_t	a;
+    uint64_t	b;
+
+    for (; 8 <= len; key += 8, ek += 8, len -= 8) {
+	memcpy(&a, key, 8);
+	memcpy(&b, ek, 8);
+	if (a != b) {
+	    return 0;
+	}
+    }
+    return 0 == len || 0 == memcmp(key, ek, len);
+}
+
+static void
+table_reset(Cache cache) {
+    cache->table = ALLOC_N(Entry, CACHE_MIN_SIZE);
+    memset(cache->table, 0, sizeof(Entry) * CACHE_MIN_SIZE);
+    cache->mask = CACHE_MIN_SIZE - 1;
+    cache->cnt = 0;
+    cache->hand = 0;
+}
 
 void
 ox_cache_new(Cache *cache) {
     *cache = ALLOC(struct _Cache);
-    (*cache)->key = 0;
-    (*cache)->value = Qundef;
-    bzero((*cache)->slots, sizeof((*cache)->slots));
+    memset(*cache, 0, sizeof(struct _Cache));
+    table_reset(*cache);
 }
 
 VALUE
 ox_cache_get(Cache cache, const char *key, VALUE **slot) {
-    unsigned char       *k = (unsigned char*)key;
-    Cache               *cp;
-
-    for (; '\0' != *k; k++) {
-        cp = cache->slots + (unsigned int)(*k >> 4); // upper 4 bits
-        if (0 == *cp) {
-            ox_cache_new(cp);
-        }
-        cache = *cp;
-        cp = cache->slots + (unsigned int)(*k & 0x0F); // lower 4 bits
-        if (0 == *cp) {
-            ox_cache_new(cp);
-            cache = *cp;
-            cache->key = ('\0' == *(k + 1)) ? 0 : strdup(key);
-            break;
-        } else {
-            cache = *cp;
-            if (Qundef != cache->value && 0 != cache->key) {
-                unsigned char   *ck = (unsigned char*)(cache->key + (unsigned int)(k - (unsigned char*)key + 1));
-
-                if (0 == strcmp((char*)ck, (char*)(k + 1))) {
-                    break;
-                } else {
-                    Cache     *cp2 = cp;
-
-                    // if value was set along with the key then there are no slots filled yet
-                    cp2 = (*cp2)->slots + (*ck >> 4);
-                    ox_cache_new(cp2);
-                    cp2 = (*cp2)->slots + (*ck & 0x0F);
-                    ox_cache_new(cp2);
-                    if ('\0' == *(ck + 1)) {
-                        xfree(cache->key);
-                    } else {
-                        (*cp2)->key = cache->key;
-                    }
-                    (*cp2)->value = cache->value;
-                    cache->key = 0;
-                    cache->value = Qundef;
-                }
-            }
-        }
-    }
-    *slot = &cache->value;
-
-    return cache->value;
+    size_t	len = strlen(key);
+
+    return ox_cache_getn(cache, key, len, ox_cache_hash(key, len), slot);
 }
 
-void
-ox_cache_print(Cache cache) {
-    //printf("-------------------------------------------\n");
-    slot_print(cache, 0);
+VALUE
+ox_cache_getn(Cache cache, const char *key, size_t len, uint32_t hash, VALUE **slot) {
+    unsigned long	i = hash & cache->mask;
+    Entry		e;
+
+    for (; 0 != (e = cache->table[i]); i = (i + 1) & cache->mask) {
+	if (hash == e->hash && len == e->len && key_eq(key, e->key, len)) {
+	    cache->hits++;
+	    e->ref = 1;
+	    *slot = &e->value;
+	    return e->value;
+	}
+    }
+    cache->misses++;
+    if (0 != cache->limit && cache->limit <= cache->cnt) {
+	evict(cache);
+	// the eviction may have shifted entries into the empty bucket
+	for (i = hash & cache->mask; 0 != cache->table[i]; i = (i + 1) & cache->mask) {
+	}
+    }
+    e = entry_new(cache, key, len, hash);
+    cache->table[i] = e;
+    cache->cnt++;
+    // keep the table at most half full so probe runs stay short
+    if (cache->mask < cache->cnt * 2) {
+	grow(cache);
+    }
+    *slot = &e->value;
+
+    return Qundef;
 }
 
+static Entry
+entry_new(Cache cache, const char *key, size_t len, uint32_t hash) {
+    size_t	size = entry_size(len);
+    Entry	e;
+
+    if (FREE_MAX < size) {
+	e = (Entry)ALLOC_N(char, size);
+	cache->big_bytes += size;
+    } else if (0 != (e = cache->free[size / 8])) {
+	cache->free[size / 8] = (Entry)e->value;
+    } else {
+	Arena	a = cache->arena;
+
+	if (0 == a || a->size - a->used < size) {
+	    // blocks start small for caches with only a few names
+	    size_t	asize = (0 == a) ? ARENA_MIN : (a->size < ARENA_MAX) ? a->size * 2 : ARENA_MAX;
+
+	    a = (Arena)ALLOC_N(char, offsetof(struct _Arena, buf) + asize);
+	    a->size = asize;
+	    a->used = 0;
+	    a->next = cache->arena;
+	    cache->arena = a;
+	}
+	e = (Entry)(a->buf + a->used);
+	a->used += size;
+    }
+    e->value = Qundef;
+    e->hash = hash;
+    e->len = (uint32_t)len;
+    e->ref = 0;
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+
+    return e;
+}
+
+static void
+entry_free(Cache cache, Entry e) {
+    size_t	size = entry_size(e->len);
+
+    if (FREE_MAX < size) {
+	cache->big_bytes -= size;
+	xfree(e);
+    } else {
+	e->value = (VALUE)cache->free[size / 8];
+	cache->free[size / 8] = e;
+    }
+}
+
+static void
+grow(Cache cache) {
+    unsigned long	size = (cache->mask + 1) * 2;
+    unsigned long	mask = size - 1;
+    Entry		*table = ALLOC_N(Entry, size);
+    Entry		*ep = cache->table;
+    Entry		*end = ep + cache->mask + 1;
+
+    memset(table, 0, sizeof(Entry) * size);
+    for (; ep < end; ep++) {
+	if (0 != *ep) {
+	    unsigned long	i = (*ep)->hash & mask;
+
+	    for (; 0 != table[i]; i = (i + 1) & mask) {
+	    }
+	    table[i] = *ep;
+	}
+    }
+    xfree(cache->table);
+    cache->table = table;
+    cache->mask = mask;
+    cache->hand = 0;
+}
+
+/* Removes the entry in bucket i and moves later entries of the same run
+ * back so no lookup stops at the hole.
+ */
 static void
-slot_print(Cache c, unsigned int depth) {
-    char                indent[256];
-    Cache               *cp;
-    unsigned int        i;
-
-    if (sizeof(indent) - 1 < depth) {
-        depth = ((int)sizeof(indent) - 1);
-    }
-    memset(indent, ' ', depth);
-    indent[depth] = '\0';
-    for (i = 0, cp = c->slots; i < 16; i++, cp++) {
-        if (0 == *cp) {
-            //printf("%s%02u:\n", indent, i);
-        } else {
-            if (0 == (*cp)->key && Qundef == (*cp)->value) {
-                printf("%s%02u:\n", indent, i);
-            } else {
-                const char      *key = (0 == (*cp)->key) ? "*" : (*cp)->key;
-                const char      *vs;
-                const char      *clas;
-
-                if (Qundef == (*cp)->value) {
-                    vs = "undefined";
-                    clas = "";
-                } else {
-                    VALUE       rs = rb_funcall2((*cp)->value, rb_intern("to_s"), 0, 0);
-
-                    vs = StringValuePtr(rs);
-                    clas = rb_class2name(rb_obj_class((*cp)->value));
-                }
-                printf("%s%02u: %s = %s (%s)\n", indent, i, key, vs, clas);
-            }
-            slot_print(*cp, depth + 2);
-        }
+remove_at(Cache cache, unsigned long i) {
+    unsigned long	mask = cache->mask;
+    unsigned long	j = i;
+    unsigned long	home;
+
+    cache->table[i] = 0;
+    cache->cnt--;
+    while (1) {
+	j = (j + 1) & mask;
+	if (0 == cache->table[j]) {
+	    break;
+	}
+	home = cache->table[j]->hash & mask;
+	// leave entries whose home bucket is cyclically in (i, j]
+	if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+	    continue;
+	}
+	cache->table[i] = cache->table[j];
+	cache->table[j] = 0;
+	i = j;
+    }
+}
+
+static void
+evict(Cache cache) {
+    unsigned long	cnt = (cache->mask + 1) * 2;
+    Entry		e;
+
+    // two turns clear every ref flag so one is enough to find an entry
+    // unless all of them are still waiting for a value
+    for (; 0 < cnt; cnt--) {
+	unsigned long	i = cache->hand;
+
+	cache->hand = (i + 1) & cache->mask;
+	if (0 == (e = cache->table[i]) || Qundef == e->value) {
+	    continue;
+	}
+	if (e->ref) {
+	    e->ref = 0;
+	    continue;
+	}
+	remove_at(cache, i);
+	entry_free(cache, e);
+	cache->evictions++;
+	break;
+    }
+}
+
+void
+ox_cache_limit(Cache cache, unsigned long limit) {
+    cache->limit = limit;
+    while (0 != limit && limit < cache->cnt) {
+	unsigned long	before = cache->cnt;
+
+	evict(cache);
+	if (before == cache->cnt) {
+	    break;
+	}
+    }
+}
+
+void
+ox_cache_clear(Cache cache) {
+    Entry		*ep = cache->table;
+    Entry		*end = ep + cache->mask + 1;
+    Entry		*table = cache->table;
+    unsigned long	size = cache->mask + 1;
+    unsigned long	pending = 0;
+
+    for (; ep < end; ep++) {
+	if (0 != *ep && Qundef == (*ep)->value) {
+	    pending++;
+	}
+    }
+    if (0 != pending) {
+	// A caller still holds a slot so the memory must stay. Only the
+	// entries with values are freed for reuse.
+	unsigned long	i;
+
+	for (i = 0; i < size; i++) {
+	    Entry	e = cache->table[i];
+
+	    if (0 != e && Qundef != e->value) {
+		remove_at(cache, i);
+		entry_free(cache, e);
+		i--; // an entry may have moved into bucket i
+	    }
+	}
+	return;
+    }
+    for (ep = table; ep < end; ep++) {
+	if (0 != *ep && FREE_MAX < entry_size((*ep)->len)) {
+	    xfree(*ep);
+	}
+    }
+    xfree(table);
+    while (0 != cache->arena) {
+	Arena	a = cache->arena;
+
+	cache->arena = a->next;
+	xfree(a);
+    }
+    cache->big_bytes = 0;
+    memset(cache->free, 0, sizeof(cache->free));
+    table_reset(cache);
+}
+
+void
+ox_cache_stats(Cache cache, CacheStats stats) {
+    Arena	a;
+    size_t	bytes = sizeof(struct _Cache) + sizeof(Entry) * (cache->mask + 1) + cache->big_bytes;
+
+    for (a = cache->arena; 0 != a; a = a->next) {
+	bytes += offsetof(struct _Arena, buf) + a->size;
+    }
+    stats->cnt = cache->cnt;
+    stats->limit = cache->limit;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bytes = (unsigned long)bytes;
+}
+
+void
+ox_cache_mark(Cache cache) {
+    Entry	*ep = cache->table;
+    Entry	*end = ep + cache->mask + 1;
+
+    for (; ep < end; ep++) {
+	if (0 != *ep && Qundef != (*ep)->value) {
+	    rb_gc_mark((*ep)->value);
+	}
+    }
+}
+
+void
+ox_cache_print(Cache cache) {
+    Entry		*ep = cache->table;
+    Entry		*end = ep + cache->mask + 1;
+    unsigned long	i;
+
+    for (i = 0; ep < end; ep++, i++) {
+	if (0 != *ep) {
+	    const char	*vs;
+	    const char	*clas;
+
+	    if (Qundef == (*ep)->value) {
+		vs = "undefined";
+		clas = "";
+	    } else {
+		VALUE	rs = rb_funcall2((*ep)->value, rb_intern("to_s"), 0, 0);
+
+		vs = StringValuePtr(rs);
+		clas = rb_class2name(rb_obj_class((*ep)->value));
+	    }
+	    printf("%4lu: %s = %s (%s)\n", i, (*ep)->key, vs, clas);
+	}
     }
 }
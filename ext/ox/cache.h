@@ -31,14 +31,70 @@
 #ifndef __OX_CACHE_H__
 #define __OX_CACHE_H__
 
+#include <stdint.h>
+#include <string.h>
+
 #include "ruby.h"
 
 typedef struct _Cache   *Cache;
 
+typedef struct _CacheStats {
+    unsigned long	cnt;
+    unsigned long	limit;
+    unsigned long	hits;
+    unsigned long	misses;
+    unsigned long	evictions;
+    unsigned long	bytes;
+} *CacheStats;
+
 extern void     ox_cache_new(Cache *cache);
 
+/* Returns the value for the '\0' terminated key or Qundef if the key was
+ * not in the cache. In either case *slot is set to where the value is kept
+ * so it can be set after a miss.
+ */
 extern VALUE    ox_cache_get(Cache cache, const char *key, VALUE **slot);
 
+/* Like ox_cache_get() but the key is len bytes long and does not need to be
+ * terminated, so a token is looked up where it was scanned. The hash must be
+ * from ox_cache_hash(), called with the same key and len at lookup time.
+ */
+extern VALUE    ox_cache_getn(Cache cache, const char *key, size_t len, uint32_t hash, VALUE **slot);
+
+extern void     ox_cache_limit(Cache cache, unsigned long limit);
+
+extern void     ox_cache_clear(Cache cache);
+
+extern void     ox_cache_stats(Cache cache, CacheStats stats);
+
+extern void     ox_cache_mark(Cache cache);
+
 extern void     ox_cache_print(Cache cache);
 
+/* Returns the hash ox_cache_getn() expects for a key. Hashes 8 bytes at a
+ * time. Names are short so the tail is read with a single memcpy() instead
+ * of a byte loop.
+ */
+inline static uint32_t
+ox_cache_hash(const char *key, size_t len) {
+    uint64_t	h = (uint64_t)len * 0x9E3779B97F4A7C15ULL;
+    uint64_t	w;
+
+    for (; 8 <= len; key += 8, len -= 8) {
+	memcpy(&w, key, 8);
+	h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 32;
+    }
+    if (0 < len) {
+	w = 0;
+	memcpy(&w, key, len);
+	h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
 #endif /* __OX_CACHE_H__ */
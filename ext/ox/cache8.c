@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,92 +9,120 @@
 #include "ruby.h"
 #include "cache8.h"
 
-#define BITS            4
-#define MASK            0x000000000000000F
-#define SLOT_CNT        16
-#define DEPTH           16
+/* An open addressing hash set of object pointers with linear probing. The
+ * low bits of an object pointer are always zero because of alignment so they
+ * are shifted out before the pointer is multiplied by a 64 bit golden ratio
+ * constant. The top bits of the product pick the bucket. The table size is a
+ * power of two and it doubles before it is more than half full.
+ */
+
+#define CACHE8_MIN_BITS	8
+#define PTR_SHIFT	3
+
+typedef struct _Bucket {
+    VALUE	key;	// 0 for an empty bucket
+    slot_t	value;
+} *Bucket;
 
 struct _Cache8 {
-    union {
-        struct _Cache8  *slots[SLOT_CNT];
-        unsigned long   values[SLOT_CNT];
-    };
+    Bucket		table;
+    unsigned long	mask;	// table size - 1
+    unsigned long	cnt;
+    int			shift;	// 64 - bits in the table index
+    slot_t		zero;	// value for a key of 0
 };
 
-static void     cache8_delete(Cache8 cache, int depth);
-static void     slot_print(Cache8 cache, VALUE key, unsigned int depth);
+inline static unsigned long
+bucket_index(VALUE key, int shift) {
+    return (unsigned long)((((uint64_t)key >> PTR_SHIFT) * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+static void
+table_new(Cache8 cache, int bits) {
+    unsigned long	size = 1UL << bits;
+
+    cache->table = ALLOC_N(struct _Bucket, size);
+    memset(cache->table, 0, sizeof(struct _Bucket) * size);
+    cache->mask = size - 1;
+    cache->shift = 64 - bits;
+}
+
+static void
+grow(Cache8 cache) {
+    Bucket	old = cache->table;
+    Bucket	end = old + cache->mask + 1;
+    Bucket	b;
+
+    table_new(cache, 64 - cache->shift + 1);
+    for (b = old; b < end; b++) {
+	if (0 != b->key) {
+	    unsigned long	i = bucket_index(b->key, cache->shift);
+
+	    for (; 0 != cache->table[i].key; i = (i + 1) & cache->mask) {
+	    }
+	    cache->table[i] = *b;
+	}
+    }
+    xfree(old);
+}
 
 void
 ox_cache8_new(Cache8 *cache) {
-    Cache8     *cp;
-    int         i;
-    
     *cache = ALLOC(struct _Cache8);
-    for (i = SLOT_CNT, cp = (*cache)->slots; 0 < i; i--, cp++) {
-        *cp = 0;
-    }
+    table_new(*cache, CACHE8_MIN_BITS);
+    (*cache)->cnt = 0;
+    (*cache)->zero = 0;
 }
 
 void
 ox_cache8_delete(Cache8 cache) {
-    cache8_delete(cache, 0);
-}
-
-static void
-cache8_delete(Cache8 cache, int depth) {
-    Cache8              *cp;
-    unsigned int        i;
-
-    for (i = 0, cp = cache->slots; i < SLOT_CNT; i++, cp++) {
-        if (0 != *cp) {
-            if (DEPTH - 1 != depth) {
-                cache8_delete(*cp, depth + 1);
-            }
-        }
-    }
+    xfree(cache->table);
     xfree(cache);
 }
 
+/* Returns the value for the key or 0 if the key was not in the cache. The
+ * slot is where the value is kept. It is only valid until the next call.
+ */
 slot_t
 ox_cache8_get(Cache8 cache, VALUE key, slot_t **slot) {
-    Cache8      *cp;
-    int         i;
-    VALUE       k;
-    
-    for (i = 64 - BITS; 0 < i; i -= BITS) {
-        k = (key >> i) & MASK;
-        cp = cache->slots + k;
-        if (0 == *cp) {
-            ox_cache8_new(cp);
-        }
-        cache = *cp;
+    Bucket		b;
+    unsigned long	i;
+
+    if (0 == key) {
+	*slot = &cache->zero;
+	return cache->zero;
+    }
+    i = bucket_index(key, cache->shift);
+    for (b = cache->table + i; 0 != b->key; b = cache->table + i) {
+	if (key == b->key) {
+	    *slot = &b->value;
+	    return b->value;
+	}
+	i = (i + 1) & cache->mask;
+    }
+    // grow before adding so the slot stays in the current table
+    if (cache->mask < (cache->cnt + 1) * 2) {
+	grow(cache);
+	for (i = bucket_index(key, cache->shift); 0 != cache->table[i].key; i = (i + 1) & cache->mask) {
+	}
+	b = cache->table + i;
     }
-    *slot = cache->values + (key & MASK);
+    b->key = key;
+    b->value = 0;
+    cache->cnt++;
+    *slot = &b->value;
 
-    return **slot;
+    return 0;
 }
 
 void
 ox_cache8_print(Cache8 cache) {
-    //printf("-------------------------------------------\n");
-    slot_print(cache, 0, 0);
-}
+    Bucket	b = cache->table;
+    Bucket	end = b + cache->mask + 1;
 
-static void
-slot_print(Cache8 c, VALUE key, unsigned int depth) {
-    Cache8              *cp;
-    unsigned int        i;
-    unsigned long       k;
-
-    for (i = 0, cp = c->slots; i < SLOT_CNT; i++, cp++) {
-        if (0 != *cp) {
-            k = (key << BITS) | i;
-            //printf("*** key: 0x%016lx  depth: %u  i: %u\n", k, depth, i);
-            if (DEPTH - 1 == depth) {
-                printf("0x%016lx: %4lu\n", k, (unsigned long)*cp);
-            } else {
-                slot_print(*cp, k, depth + 1);
-            }
-        }
+    for (; b < end; b++) {
+	if (0 != b->key) {
+	    printf("0x%016lx: %4lu\n", (unsigned long)b->key, (unsigned long)b->value);
+	}
     }
 }
@@ -42,6 +42,32 @@ static slot_t data[] = {
     0
 };
 
+/* Adds object like pointers, 40 bytes apart, through several table growths
+ * and checks every one of them still has its value.
+ */
+static void
+many_test() {
+    Cache8      c;
+    slot_t      *slot;
+    slot_t      i;
+    long        errors = 0;
+
+    ox_cache8_new(&c);
+    for (i = 1; i <= 100000; i++) {
+        if (0 != ox_cache8_get(c, (VALUE)(0x00007F0000000000UL + i * 40), &slot)) {
+            errors++;
+        }
+        *slot = i;
+    }
+    for (i = 1; i <= 100000; i++) {
+        if (i != ox_cache8_get(c, (VALUE)(0x00007F0000000000UL + i * 40), &slot)) {
+            errors++;
+        }
+    }
+    printf("*** 100000 keys with %ld errors\n", errors);
+    ox_cache8_delete(c);
+}
+
 void
 ox_cache8_test() {
     Cache8      c;
@@ -66,4 +92,6 @@ ox_cache8_test() {
         //ox_cache8_print(c);
     }
     ox_cache8_print(c);
+    ox_cache8_delete(c);
+    many_test();
 }
@@ -28,8 +28,15 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
 #include "cache.h"
 
+#define BENCH_NAMES	10000
+#define BENCH_ITER	200
+
 static const char       *data[] = {
     "one",
     "two",
@@ -40,8 +47,141 @@ static const char       *data[] = {
     0
 };
 
+static double
+now() {
+    struct timeval	tv;
+
+    gettimeofday(&tv, 0);
+
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+// Element and attribute like names of 2 to 33 characters.
+static void
+make_names(char names[][40], int cnt) {
+    static const char	*words[] = { "item", "name", "value", "description", "x", "created_at", "id", "Weather", 0 };
+    int			wcnt = 0;
+    int			i;
+
+    for (; 0 != words[wcnt]; wcnt++) {
+    }
+    for (i = 0; i < cnt; i++) {
+	sprintf(names[i], "%s%d%s", words[i % wcnt], i, (0 == i % 3) ? words[(i / 3) % wcnt] : "");
+    }
+}
+
+/* Checks that every name gets its own slot and then times lookups of names
+ * that are all in the cache, the common case when parsing, against
+ * rb_intern() which would be used without the cache.
+ */
+static void
+bench(char names[][40], int ncnt) {
+    static size_t	lens[BENCH_NAMES];
+    Cache		c;
+    VALUE		*slot;
+    struct _CacheStats	stats;
+    unsigned long	klen = 0;
+    double		start;
+    double		dt;
+    long		errors = 0;
+    long		iter = (long)BENCH_ITER * BENCH_NAMES / ncnt;
+    long		j;
+    int			i;
+
+    ox_cache_new(&c);
+    for (i = 0; i < ncnt; i++) {
+	if (Qundef != ox_cache_get(c, names[i], &slot)) {
+	    errors++;
+	}
+	*slot = LONG2NUM(i);
+	klen += strlen(names[i]);
+    }
+    for (i = 0; i < ncnt; i++) {
+	if (LONG2NUM(i) != ox_cache_get(c, names[i], &slot)) {
+	    errors++;
+	}
+    }
+    ox_cache_stats(c, &stats);
+    printf("%lu names averaging %.1f characters, %ld errors, %.1f bytes per entry\n",
+	   stats.cnt, (double)klen / ncnt, errors, (double)stats.bytes / stats.cnt);
+
+    start = now();
+    for (j = 0; j < iter; j++) {
+	for (i = 0; i < ncnt; i++) {
+	    ox_cache_get(c, names[i], &slot);
+	}
+    }
+    dt = now() - start;
+    printf("ox_cache_get: %.0f lookups/sec\n", (double)ncnt * iter / dt);
+
+    for (i = 0; i < ncnt; i++) {
+	lens[i] = strlen(names[i]);
+    }
+    start = now();
+    for (j = 0; j < iter; j++) {
+	for (i = 0; i < ncnt; i++) {
+	    ox_cache_getn(c, names[i], lens[i], ox_cache_hash(names[i], lens[i]), &slot);
+	}
+    }
+    dt = now() - start;
+    printf("ox_cache_getn: %.0f lookups/sec\n", (double)ncnt * iter / dt);
+
+    start = now();
+    for (j = 0; j < iter; j++) {
+	for (i = 0; i < ncnt; i++) {
+	    rb_intern(names[i]);
+	}
+    }
+    dt = now() - start;
+    printf("rb_intern:    %.0f lookups/sec\n", (double)ncnt * iter / dt);
+}
+
+/* Runs names through a cache limited to 1000 entries while a few hot names
+ * are looked up between each of them. Every hit must return the value set
+ * for that name, the size must stay at the limit and the hot names should
+ * survive the evictions.
+ */
+static void
+limit_test(char names[][40]) {
+    Cache		c;
+    VALUE		*slot;
+    VALUE		v;
+    struct _CacheStats	stats;
+    long		errors = 0;
+    long		hot_misses = 0;
+    int			i, j;
+
+    ox_cache_new(&c);
+    ox_cache_limit(c, 1000);
+    for (j = 0; j < 3; j++) {
+	for (i = 0; i < BENCH_NAMES; i++) {
+	    if (Qundef == (v = ox_cache_get(c, names[i], &slot))) {
+		*slot = LONG2NUM(i);
+	    } else if (LONG2NUM(i) != v) {
+		errors++;
+	    }
+	    if (Qundef == (v = ox_cache_get(c, names[i % 16], &slot))) {
+		*slot = LONG2NUM(i % 16);
+		hot_misses++;
+	    } else if (LONG2NUM(i % 16) != v) {
+		errors++;
+	    }
+	}
+    }
+    ox_cache_stats(c, &stats);
+    if (1000 < stats.cnt) {
+	errors++;
+    }
+    printf("limit %lu: %lu names, %lu hits, %lu misses, %lu evictions, %ld hot misses, %lu bytes, %ld errors\n",
+	   stats.limit, stats.cnt, stats.hits, stats.misses, stats.evictions, hot_misses, stats.bytes, errors);
+    ox_cache_clear(c);
+    ox_cache_stats(c, &stats);
+    printf("cleared: %lu names, %lu bytes\n", stats.cnt, stats.bytes);
+}
+
 void
 ox_cache_test() {
+    static char	names[BENCH_NAMES][40];
     Cache       c;
     const char  **d;
     VALUE       v;
@@ -66,4 +206,9 @@ ox_cache_test() {
         //ox_cache_print(c);
     }
     ox_cache_print(c);
+
+    make_names(names, BENCH_NAMES);
+    bench(names, BENCH_NAMES);
+    bench(names, 8);
+    limit_test(names);
 }
@@ -0,0 +1,54 @@
+/* dtoa.h
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OX_DTOA_H__
+#define __OX_DTOA_H__
+
+/* Space needed by ox_dbl_to_str() including the terminating '\0'. */
+#define OX_DBL_BUF_SIZE	32
+
+/* Parses a decimal floating point number from s up to end and returns it.
+ * Leading white space and trailing characters are ignored the same way
+ * strtod() ignores them but the decimal point is always '.' no matter what
+ * the locale is. The hexadecimal form strtod() reads is accepted as well.
+ * Numbers that are exact in a double or that can be rounded correctly with
+ * 128 bit products, nearly all of them, are converted without a call to
+ * strtod(). Returns 0.0 if there is no number.
+ */
+extern double	ox_str_to_dbl(const char *s, const char *end);
+
+/* Writes the shortest decimal string that reads back as d into buf, which
+ * must hold at least OX_DBL_BUF_SIZE characters. The format matches the %g
+ * format of printf() except for the number of digits. Returns the length of
+ * the string.
+ */
+extern int	ox_dbl_to_str(double d, char *buf);
+
+#endif /* __OX_DTOA_H__ */
@@ -36,10 +36,19 @@
 
 #include "base64.h"
 #include "cache8.h"
+#include "dtoa.h"
 #include "ox.h"
+#include "scan.h"
 
 #define USE_B64	0
 
+// shortest frozen String to remember the escaping of
+#define STR_CACHE_MIN	256
+
+// values in the frozen String cache
+#define FriendlyStr	1
+#define EscapeStr	2
+
 typedef unsigned long   ulong;
 
 typedef struct _Str {
@@ -65,10 +74,16 @@ typedef struct _Out {
     char                *cur;
     Cache8              circ_cache;
     unsigned long       circ_cnt;
+    Cache8              str_cache; // frozen String to FriendlyStr or EscapeStr
     int                 indent;
     int                 depth; // used by dumpHash
     Options             opts;
     VALUE		obj;
+    FILE                *f;     // streaming sink, written to as the buffer fills
+    VALUE               io;     // streaming sink if not Qnil, written to with write()
+    size_t              flushed; // bytes already written to the sink
+    VALUE               str;    // if not Qnil the String buf points into
+    DumpBuf             keep;   // if not 0 the buffer is handed back here instead of freed
 } *Out;
 
 static void     dump_obj_to_xml(VALUE obj, Options copts, Out out);
@@ -87,9 +102,11 @@ static void     dump_start(Out out, Element e);
 static void     dump_end(Out out, Element e);
 
 static void     grow(Out out, size_t len);
+static void     flush_out(Out out);
 
 static void     dump_value(Out out, const char *value, size_t size);
-static void     dump_str_value(Out out, const char *value, size_t size);
+static int      dump_str_value(Out out, const char *value, size_t size);
+static void     dump_rstr_value(Out out, VALUE obj, const char *value, size_t size);
 static int      dump_var(ID key, VALUE value, Out out);
 static void     dump_num(Out out, VALUE obj);
 static void     dump_date(Out out, VALUE obj);
@@ -111,24 +128,68 @@ static char     xml_friendly_chars[256] = "\
 11111111111111111111111111111111\
 11111111111111111111111111111111";
 
+#if OX_SCAN_SSE2
+// Returns a bit mask of the bytes in v that might not be xml friendly. All
+// control characters are flagged, including the friendly tab, newline and
+// return, so flagged bytes have to be checked again against the table.
 inline static int
-is_xml_friendly(const u_char *str, int len) {
-    for (; 0 < len; str++, len--) {
+sse_unfriendly(__m128i v) {
+    __m128i	m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v);
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/* Returns a pointer to the first character that is not xml friendly or end
+ * if there is none. Most strings need no escaping so with SSE2 the string is
+ * checked 32 bytes at a time, then 16, using unaligned loads that never read
+ * past end. The last few bytes are checked one at a time.
+ */
+inline static const u_char*
+xml_unfriendly(const u_char *str, const u_char *end) {
+#if OX_SCAN_SSE2
+    unsigned int	mask;
+
+    for (; str + 32 <= end; str += 32) {
+	mask = (unsigned int)sse_unfriendly(_mm_loadu_si128((const __m128i*)str)) |
+	    ((unsigned int)sse_unfriendly(_mm_loadu_si128((const __m128i*)(str + 16))) << 16);
+	for (; 0 != mask; mask &= mask - 1) {
+	    const u_char	*s = str + __builtin_ctz(mask);
+
+	    if ('1' != xml_friendly_chars[*s]) {
+		return s;
+	    }
+	}
+    }
+    if (str + 16 <= end) {
+	mask = (unsigned int)sse_unfriendly(_mm_loadu_si128((const __m128i*)str));
+	for (; 0 != mask; mask &= mask - 1) {
+	    const u_char	*s = str + __builtin_ctz(mask);
+
+	    if ('1' != xml_friendly_chars[*s]) {
+		return s;
+	    }
+	}
+	str += 16;
+    }
+#endif
+    for (; str < end; str++) {
         if ('1' != xml_friendly_chars[*str]) {
-            return 0;
+            return str;
         }
     }
-    return 1;
+    return end;
 }
 
-inline static size_t
-xml_str_len(const u_char *str, size_t len) {
-    size_t	size = 0;
-
-    for (; 0 < len; str++, len--) {
-	size += xml_friendly_chars[*str];
-    }
-    return size - len * (size_t)'0';
+inline static int
+is_xml_friendly(const u_char *str, int len) {
+    return (str + len == xml_unfriendly(str, str + len));
 }
 
 inline static void
@@ -251,18 +312,66 @@ check_circular(Out out, VALUE obj, Element e) {
 
 static void
 grow(Out out, size_t len) {
-    size_t  size = out->end - out->buf;
-    long    pos = out->cur - out->buf;
-        
+    size_t  size;
+    long    pos;
+
+    if (0 != out->f || Qnil != out->io) {
+        // Streaming so write out what is ready and reuse the buffer. It only
+        // gets bigger if a single value will not fit.
+        flush_out(out);
+        if ((long)len < out->end - out->cur) {
+            return;
+        }
+    }
+    size = out->end - out->buf;
+    pos = out->cur - out->buf;
     size *= 2;
     if (size <= len * 2 + pos) {
         size += len;
     }
-    REALLOC_N(out->buf, char, size + 10); // 10 extra for terminator character plus extra (paranoid)
+    if (Qnil != out->str) {
+        rb_str_resize(out->str, size + 10); // 10 extra for terminator character plus extra (paranoid)
+        out->buf = RSTRING_PTR(out->str);
+    } else {
+        REALLOC_N(out->buf, char, size + 10); // 10 extra for terminator character plus extra (paranoid)
+    }
     out->end = out->buf + size;
     out->cur = out->buf + pos;
 }
 
+static void
+flush_out(Out out) {
+    size_t      size = out->cur - out->buf;
+
+    if (0 == size) {
+        return;
+    }
+    if (0 != out->f) {
+        if (size != fwrite(out->buf, 1, size, out->f)) {
+            int err = ferror(out->f);
+            rb_raise(rb_eIOError, "Write failed. [%d:%s]\n", err, strerror(err));
+        }
+    } else {
+        VALUE   rstr = rb_str_new(out->buf, size);
+
+#if HAS_ENCODING_SUPPORT
+        if ('\0' != *out->opts->encoding) {
+            rb_enc_associate(rstr, rb_enc_find(out->opts->encoding));
+        }
+#endif
+        rb_funcall(out->io, ox_write_id, 1, rstr);
+    }
+    out->flushed += size;
+    out->cur = out->buf;
+}
+
+// True if anything has been written, either still in the buffer or already
+// flushed to the sink.
+inline static int
+out_started(Out out) {
+    return (out->buf < out->cur || 0 < out->flushed);
+}
+
 static void
 dump_start(Out out, Element e) {
     size_t      size = e->indent + 4;
@@ -279,7 +388,7 @@ dump_start(Out out, Element e) {
     if (out->end - out->cur <= (long)size) {
         grow(out, size);
     }
-    if (out->buf < out->cur) {
+    if (out_started(out)) {
         fill_indent(out, e->indent);
     }
     *out->cur++ = '<';
@@ -335,56 +444,100 @@ dump_value(Out out, const char *value, size_t size) {
     *out->cur = '\0';
 }
 
-inline static void
+/* Escapes and copies the value in one pass. Room for the value as is is
+ * made up front since most values need no escaping and more is made only
+ * when an escape is reached. Returns 1 if nothing needed escaping.
+ */
+inline static int
 dump_str_value(Out out, const char *value, size_t size) {
-    size_t	xsize = xml_str_len((const u_char*)value, size);
+    const u_char	*str = (const u_char*)value;
+    const u_char	*end = str + size;
+    const u_char	*u;
+    int			friendly = 1;
 
-    if (out->end - out->cur <= (long)xsize) {
-        grow(out, xsize);
+    if (out->end - out->cur <= (long)size) {
+        grow(out, size);
     }
-    for (; '\0' != *value; value++) {
-	if ('1' == xml_friendly_chars[(u_char)*value]) {
-	    *out->cur++ = *value;
-	} else {
-	    *out->cur++ = '&';
-	    switch (*value) {
-	    case '"':
-		*out->cur++ = 'q';
-		*out->cur++ = 'u';
-		*out->cur++ = 'o';
-		*out->cur++ = 't';
-		break;
-	    case '&':
-		*out->cur++ = 'a';
-		*out->cur++ = 'm';
-		*out->cur++ = 'p';
-		break;
-	    case '\'':
-		*out->cur++ = 'a';
-		*out->cur++ = 'p';
-		*out->cur++ = 'o';
-		*out->cur++ = 's';
-		break;
-	    case '<':
-		*out->cur++ = 'l';
-		*out->cur++ = 't';
-		break;
-	    case '>':
-		*out->cur++ = 'g';
-		*out->cur++ = 't';
-		break;
-	    default:
-		*out->cur++ = '#';
-		*out->cur++ = 'x';
-		*out->cur++ = '0';
-		*out->cur++ = '0';
-		dump_hex(*value, out);
-		break;
-	    }
-	    *out->cur++ = ';';
+    for (; str < end; str = u + 1) {
+	// copy the run of friendly characters in one go
+	u = xml_unfriendly(str, end);
+	memcpy(out->cur, str, u - str);
+	out->cur += u - str;
+	if (end <= u) {
+	    break;
+	}
+	friendly = 0;
+	// an escape is up to 8 characters where only 1 was planned for
+	if (out->end - out->cur <= (end - u) + 8) {
+	    grow(out, (end - u) + 8);
+	}
+	*out->cur++ = '&';
+	switch (*u) {
+	case '"':
+	    *out->cur++ = 'q';
+	    *out->cur++ = 'u';
+	    *out->cur++ = 'o';
+	    *out->cur++ = 't';
+	    break;
+	case '&':
+	    *out->cur++ = 'a';
+	    *out->cur++ = 'm';
+	    *out->cur++ = 'p';
+	    break;
+	case '\'':
+	    *out->cur++ = 'a';
+	    *out->cur++ = 'p';
+	    *out->cur++ = 'o';
+	    *out->cur++ = 's';
+	    break;
+	case '<':
+	    *out->cur++ = 'l';
+	    *out->cur++ = 't';
+	    break;
+	case '>':
+	    *out->cur++ = 'g';
+	    *out->cur++ = 't';
+	    break;
+	default:
+	    *out->cur++ = '#';
+	    *out->cur++ = 'x';
+	    *out->cur++ = '0';
+	    *out->cur++ = '0';
+	    dump_hex(*u, out);
+	    break;
 	}
+	*out->cur++ = ';';
     }
     *out->cur = '\0';
+
+    return friendly;
+}
+
+/* Dumps the value of a String. A frozen String is often one shared or
+ * deduplicated String that shows up many times in the same dump, so whether
+ * it needs escaping is remembered for the rest of the dump. Those that do
+ * not are then copied without being scanned again. Strings shorter than
+ * STR_CACHE_MIN are quicker to scan than to look up.
+ */
+static void
+dump_rstr_value(Out out, VALUE obj, const char *value, size_t size) {
+    slot_t	*slot;
+    slot_t	friendly;
+
+    if (size < STR_CACHE_MIN || !OBJ_FROZEN(obj)) {
+	dump_str_value(out, value, size);
+	return;
+    }
+    if (0 == out->str_cache) {
+	ox_cache8_new(&out->str_cache);
+    }
+    if (0 == (friendly = ox_cache8_get(out->str_cache, obj, &slot))) {
+	*slot = dump_str_value(out, value, size) ? FriendlyStr : EscapeStr;
+    } else if (FriendlyStr == friendly) {
+	dump_value(out, value, size);
+    } else {
+	dump_str_value(out, value, size);
+    }
 }
 
 inline static void
@@ -534,13 +687,13 @@ dump_first_obj(VALUE obj, Out out) {
     }
     if (Yes == copts->with_instruct) {
         cnt = sprintf(buf, "%s<?ox version=\"1.0\" mode=\"object\"%s%s?>",
-                      (out->buf < out->cur) ? "\n" : "",
+                      out_started(out) ? "\n" : "",
                       (Yes == copts->circular) ? " circular=\"yes\"" : ((No == copts->circular) ? " circular=\"no\"" : ""),
                       (Yes == copts->xsd_date) ? " xsd_date=\"yes\"" : ((No == copts->xsd_date) ? " xsd_date=\"no\"" : ""));
         dump_value(out, buf, cnt);
     }
     if (Yes == copts->with_dtd) {
-        cnt = sprintf(buf, "%s<!DOCTYPE %c SYSTEM \"ox.dtd\">", (out->buf < out->cur) ? "\n" : "", obj_class_code(obj));
+        cnt = sprintf(buf, "%s<!DOCTYPE %c SYSTEM \"ox.dtd\">", out_started(out) ? "\n" : "", obj_class_code(obj));
         dump_value(out, buf, cnt);
     }
     dump_obj(0, obj, 0, out);
@@ -635,7 +788,7 @@ dump_obj(ID aid, VALUE obj, unsigned int depth, Out out) {
         break;
     case T_FLOAT:
         e.type = FloatCode;
-        cnt = sprintf(value_buf, "%0.16g", rb_num2dbl(obj)); // used sprintf due to bug in snprintf
+        cnt = ox_dbl_to_str(rb_num2dbl(obj), value_buf);
         out->w_start(out, &e);
         dump_value(out, value_buf, cnt);
         e.indent = -1;
@@ -654,7 +807,8 @@ dump_obj(ID aid, VALUE obj, unsigned int depth, Out out) {
         if (is_xml_friendly((u_char*)str, cnt)) {
             e.type = StringCode;
             out->w_start(out, &e);
-            dump_str_value(out, str, cnt);
+            // nothing to escape so copy as is rather than scan again
+            dump_value(out, str, cnt);
             e.indent = -1;
             out->w_end(out, &e);
         } else {
@@ -671,7 +825,7 @@ dump_obj(ID aid, VALUE obj, unsigned int depth, Out out) {
 #else
 	e.type = StringCode;
 	out->w_start(out, &e);
-	dump_str_value(out, str, cnt);
+	dump_rstr_value(out, obj, str, cnt);
 	e.indent = -1;
 	out->w_end(out, &e);
 #endif
@@ -1000,7 +1154,7 @@ dump_gen_doc(VALUE obj, unsigned int depth, Out out) {
         dump_value(out, "?>", 2);
     }
     if (Yes == out->opts->with_instruct) {
-        if (out->buf < out->cur) {
+        if (out_started(out)) {
             dump_value(out, "\n<?ox version=\"1.0\" mode=\"generic\"?>", 36);
         } else {
             dump_value(out, "<?ox version=\"1.0\" mode=\"generic\"?>", 35);
@@ -1074,7 +1228,7 @@ dump_gen_nodes(VALUE obj, unsigned int depth, Out out) {
             if (ox_element_clas == clas) {
                 dump_gen_element(*np, d2, out);
             } else if (rb_cString == clas) {
-                dump_str_value(out, StringValuePtr(*np), RSTRING_LEN(*np));
+                dump_rstr_value(out, *np, StringValuePtr(*np), RSTRING_LEN(*np));
                 indent_needed = (1 == cnt) ? 0 : 1;
             } else if (ox_comment_clas == clas) {
                 dump_gen_val_node(*np, d2, "<!-- ", 5, " -->", 4, out);
@@ -1103,7 +1257,7 @@ dump_gen_attr(VALUE key, VALUE value, Out out) {
     fill_value(out, ks, klen);
     *out->cur++ = '=';
     *out->cur++ = '"';
-    dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value));
+    dump_rstr_value(out, value, StringValuePtr(value), RSTRING_LEN(value));
     *out->cur++ = '"';
 
     return ST_CONTINUE;
@@ -1147,11 +1301,9 @@ dump_obj_to_xml(VALUE obj, Options copts, Out out) {
     VALUE       clas = rb_obj_class(obj);
 
     out->w_time = (Yes == copts->xsd_date) ? dump_time_xsd : dump_time_thin;
-    out->buf = ALLOC_N(char, 65336);
-    out->end = out->buf + 65325; // 10 less than end plus extra for possible errors
     out->cur = out->buf;
-    out->circ_cache = 0;
     out->circ_cnt = 0;
+    out->flushed = 0;
     out->opts = copts;
     out->obj = obj;
     if (Yes == copts->circular) {
@@ -1168,34 +1320,118 @@ dump_obj_to_xml(VALUE obj, Options copts, Out out) {
         dump_first_obj(obj, out);
     }
     dump_value(out, "\n", 1);
-    if (Yes == copts->circular) {
+    if (0 != out->f || Qnil != out->io) {
+        flush_out(out);
+    }
+}
+
+static VALUE
+dump_protected(VALUE x) {
+    Out out = (Out)x;
+
+    dump_obj_to_xml(out->obj, out->opts, out);
+
+    return Qnil;
+}
+
+static VALUE
+dump_cleanup(VALUE x) {
+    Out out = (Out)x;
+
+    if (0 != out->circ_cache) {
         ox_cache8_delete(out->circ_cache);
     }
+    if (0 != out->str_cache) {
+        ox_cache8_delete(out->str_cache);
+    }
+    if (Qnil == out->str) {
+        if (0 != out->keep) {
+            out->keep->buf = out->buf;
+            out->keep->size = out->end - out->buf;
+        } else {
+            xfree(out->buf);
+        }
+    }
+    if (0 != out->f) {
+        fclose(out->f);
+    }
+    return Qnil;
 }
 
-char*
-ox_write_obj_to_str(VALUE obj, Options copts) {
+/* Sets up the buffer and runs the dump. When writing to a String the String
+ * itself is the buffer so there is nothing to copy at the end. When writing
+ * to a file or IO the buffer is a fixed size window that is written out each
+ * time it fills so memory use does not depend on the size of the document.
+ * If a stream dump fails part way through whatever was already written stays
+ * written. The buffer, circular reference cache, and file are released even
+ * if the dump raises.
+ */
+static void
+dump_with_out(VALUE obj, Options copts, Out out, size_t size) {
+    if (Qnil != out->str) {
+        out->buf = RSTRING_PTR(out->str);
+    } else if (0 != out->keep && 0 != out->keep->buf) {
+        out->buf = out->keep->buf;
+        size = out->keep->size;
+        out->keep->buf = 0;
+    } else {
+        out->buf = ALLOC_N(char, size + 10);
+    }
+    out->end = out->buf + size; // 10 less than end plus extra for possible errors
+    out->circ_cache = 0;
+    out->str_cache = 0;
+    out->obj = obj;
+    out->opts = copts;
+    rb_ensure(dump_protected, (VALUE)out, dump_cleanup, (VALUE)out);
+}
+
+VALUE
+ox_write_obj_to_str(VALUE obj, Options copts, size_t size) {
     struct _Out out;
-    
-    dump_obj_to_xml(obj, copts, &out);
-    return out.buf;
+
+    if (size < 1024) {
+        size = 1024;
+    }
+    out.f = 0;
+    out.io = Qnil;
+    out.keep = 0;
+    out.str = rb_str_new(0, size + 10);
+    dump_with_out(obj, copts, &out, size);
+    size = out.cur - out.buf;
+    if ((size_t)(out.end - out.cur) <= size / 8 + 1024) {
+        // close enough to the right size to keep as is without a realloc
+        rb_str_set_len(out.str, size);
+    } else {
+        rb_str_resize(out.str, size);
+    }
+#if HAS_ENCODING_SUPPORT
+    if ('\0' != *copts->encoding) {
+	rb_enc_associate(out.str, rb_enc_find(copts->encoding));
+    }
+#endif
+    return out.str;
 }
 
 void
 ox_write_obj_to_file(VALUE obj, const char *path, Options copts) {
     struct _Out out;
-    size_t      size;
-    FILE        *f;    
 
-    dump_obj_to_xml(obj, copts, &out);
-    size = out.cur - out.buf;
-    if (0 == (f = fopen(path, "w"))) {
+    if (0 == (out.f = fopen(path, "w"))) {
         rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
-    if (size != fwrite(out.buf, 1, size, f)) {
-        int err = ferror(f);
-        rb_raise(rb_eIOError, "Write failed. [%d:%s]\n", err, strerror(err));
-    }
-    xfree(out.buf);
-    fclose(f);
+    out.io = Qnil;
+    out.str = Qnil;
+    out.keep = 0;
+    dump_with_out(obj, copts, &out, OX_DUMP_CHUNK_SIZE);
+}
+
+void
+ox_write_obj_to_io(VALUE obj, VALUE io, Options copts, DumpBuf keep) {
+    struct _Out out;
+
+    out.f = 0;
+    out.io = io;
+    out.str = Qnil;
+    out.keep = keep;
+    dump_with_out(obj, copts, &out, OX_DUMP_CHUNK_SIZE);
 }
@@ -45,6 +45,9 @@ dflags.each do |k,v|
   end
 end
 $CPPFLAGS += ' -Wall'
+have_header('sys/mman.h')
+have_func('rb_time_timespec_new')
+have_type('rb_data_type_t', 'ruby.h')
 #puts "*** $CPPFLAGS: #{$CPPFLAGS}"
 create_makefile(extension_name)
 
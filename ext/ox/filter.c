@@ -0,0 +1,163 @@
+/* filter.c
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+static void
+node_free(FNode node) {
+    FNode	next;
+
+    for (; 0 != node; node = next) {
+        next = node->next;
+        node_free(node->child);
+        if (0 != node->name) {
+            xfree(node->name);
+        }
+        xfree(node);
+    }
+}
+
+static void
+filter_free(Filter f) {
+    node_free(f->root.child);
+    xfree(f);
+}
+
+/* Adds one path such as "/table/row/cell" to the tree. A step of * matches
+ * any element name.
+ */
+static void
+add_path(Filter f, const char *path) {
+    FNode	parent = &f->root;
+    const char	*s = path;
+    const char	*end;
+    size_t	len;
+
+    if ('/' == *s) {
+        s++;
+    }
+    if ('\0' == *s) {
+        rb_raise(rb_eArgError, "filter path '%s' is empty.\n", path);
+    }
+    for (; '\0' != *s; s = ('\0' == *end) ? end : end + 1) {
+        FNode	node;
+
+        if (0 == (end = strchr(s, '/'))) {
+            end = s + strlen(s);
+        }
+        if (s == end) {
+            rb_raise(rb_eArgError, "filter path '%s' has an empty step.\n", path);
+        }
+        len = end - s;
+        for (node = parent->child; 0 != node; node = node->next) {
+            if (0 == node->name) {
+                if (1 == len && '*' == *s) {
+                    break;
+                }
+            } else if (strlen(node->name) == len && 0 == strncmp(node->name, s, len)) {
+                break;
+            }
+        }
+        if (0 == node) {
+            node = ALLOC(struct _FNode);
+            node->child = 0;
+            node->match = 0;
+            if (1 == len && '*' == *s) {
+                node->name = 0;
+            } else {
+                node->name = ALLOC_N(char, len + 1);
+                memcpy(node->name, s, len);
+                node->name[len] = '\0';
+            }
+            node->next = parent->child;
+            parent->child = node;
+        }
+        parent = node;
+    }
+    parent->match = 1;
+}
+
+/* Compiles a path or an Array of paths into a Filter. The returned object
+ * owns the Filter and frees it when collected so it must be kept alive while
+ * the Filter is in use.
+ */
+VALUE
+ox_filter_new(VALUE paths, Filter *fp) {
+    Filter	f = ALLOC(struct _Filter);
+    VALUE	fobj;
+    long	i;
+
+    memset(f, 0, sizeof(struct _Filter));
+    fobj = Data_Wrap_Struct(rb_cObject, 0, filter_free, f);
+    if (T_STRING == rb_type(paths)) {
+        add_path(f, StringValuePtr(paths));
+    } else if (T_ARRAY == rb_type(paths)) {
+        if (OX_FILTER_MAX < RARRAY_LEN(paths)) {
+            rb_raise(rb_eArgError, "A filter can have at most %d paths.\n", OX_FILTER_MAX);
+        }
+        for (i = 0; i < RARRAY_LEN(paths); i++) {
+            VALUE	p = rb_ary_entry(paths, i);
+
+            add_path(f, StringValuePtr(p));
+        }
+    } else {
+        rb_raise(rb_eArgError, ":filter must be a String or an Array of Strings.\n");
+    }
+    *fp = f;
+
+    return fobj;
+}
+
+/* Moves from the current states to those reached by an element with the
+ * given name. The next array must hold OX_FILTER_MAX entries.
+ */
+int
+ox_filter_step(FNode *states, int cnt, const char *name, FNode *next, int *ncnt) {
+    FNode	*end = states + cnt;
+    FNode	node;
+    int		n = 0;
+
+    for (; states < end; states++) {
+        for (node = (*states)->child; 0 != node; node = node->next) {
+            if (0 == node->name || 0 == strcmp(node->name, name)) {
+                if (node->match) {
+                    return OX_FILTER_MATCH;
+                }
+                next[n++] = node;
+            }
+        }
+    }
+    *ncnt = n;
+
+    return (0 < n) ? OX_FILTER_PATH : OX_FILTER_NONE;
+}
@@ -0,0 +1,63 @@
+/* filter.h
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OX_FILTER_H__
+#define __OX_FILTER_H__
+
+#include "ruby.h"
+
+/* The most paths a filter can have. It is also the most states that can be
+ * active at once since each path adds at most one node at each depth.
+ */
+#define OX_FILTER_MAX	64
+
+/* Results of a step. */
+#define OX_FILTER_NONE	0	// nothing selected at or below the element
+#define OX_FILTER_PATH	1	// on the way to a selected element
+#define OX_FILTER_MATCH	2	// the element is selected
+
+/* A node in the tree of path steps. Paths that share leading steps share
+ * nodes.
+ */
+typedef struct _FNode {
+    struct _FNode	*next;		// next sibling
+    struct _FNode	*child;		// first child
+    char		*name;		// 0 for * which matches any name
+    int			match;		// a path ends here
+} *FNode;
+
+typedef struct _Filter {
+    struct _FNode	root;
+} *Filter;
+
+extern VALUE	ox_filter_new(VALUE paths, Filter *fp);
+extern int	ox_filter_step(FNode *states, int cnt, const char *name, FNode *next, int *ncnt);
+
+#endif /* __OX_FILTER_H__ */
@@ -36,17 +36,18 @@
 
 #include "ruby.h"
 #include "ox.h"
+#include "time_parse.h"
 
-static void     instruct(PInfo pi, const char *target, Attr attrs);
+static void     instruct(PInfo pi, const char *target, size_t tlen, Attr attrs);
 static void	create_doc(PInfo pi);
-static void     create_prolog_doc(PInfo pi, const char *target, Attr attrs);
-static void     nomode_instruct(PInfo pi, const char *target, Attr attrs);
-static void     add_doctype(PInfo pi, const char *docType);
-static void     add_comment(PInfo pi, const char *comment);
+static void     create_prolog_doc(PInfo pi, Attr attrs);
+static void     nomode_instruct(PInfo pi, const char *target, size_t tlen, Attr attrs);
+static void     add_doctype(PInfo pi, const char *docType, size_t len);
+static void     add_comment(PInfo pi, const char *comment, size_t len);
 static void     add_cdata(PInfo pi, const char *cdata, size_t len);
-static void     add_text(PInfo pi, char *text, int closed);
-static void     add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren);
-static void     end_element(PInfo pi, const char *ename);
+static void     add_text(PInfo pi, const char *text, size_t len, int closed);
+static void     add_element(PInfo pi, const char *ename, size_t elen, Attr attrs, int hasChildren);
+static void     end_element(PInfo pi, const char *ename, size_t elen);
 
 extern ParseCallbacks   ox_obj_callbacks;
 
@@ -101,7 +102,7 @@ create_doc(PInfo pi) {
 }
 
 static void
-create_prolog_doc(PInfo pi, const char *target, Attr attrs) {
+create_prolog_doc(PInfo pi, Attr attrs) {
     VALUE       doc;
     VALUE       ah;
     VALUE       nodes;
@@ -127,16 +128,16 @@ create_prolog_doc(PInfo pi, const char *target, Attr attrs) {
 #else
 	    sym = ID2SYM(rb_intern(attrs->name));
 #endif
-	    rb_hash_aset(ah, sym, rb_str_new2(attrs->value));
+	    rb_hash_aset(ah, sym, rb_str_new(attrs->value, attrs->vlen));
 	} else {
-	    VALUE	rstr = rb_str_new2(attrs->name);
+	    VALUE	rstr = rb_str_new(attrs->name, attrs->nlen);
 
 #if HAS_ENCODING_SUPPORT
 	    if (0 != pi->encoding) {
 		rb_enc_associate(rstr, pi->encoding);
 	    }
 #endif
-	    rb_hash_aset(ah, rstr, rb_str_new2(attrs->value));
+	    rb_hash_aset(ah, rstr, rb_str_new(attrs->value, attrs->vlen));
 	}
 #if HAS_ENCODING_SUPPORT
 	if (0 == strcmp("encoding", attrs->name)) {
@@ -152,10 +153,10 @@ create_prolog_doc(PInfo pi, const char *target, Attr attrs) {
 }
 
 static void
-instruct(PInfo pi, const char *target, Attr attrs) {
-    if (0 == strcmp("xml", target)) {
-        create_prolog_doc(pi, target, attrs);
-    } else if (0 == strcmp("ox", target)) {
+instruct(PInfo pi, const char *target, size_t tlen, Attr attrs) {
+    if (name_is(target, tlen, "xml")) {
+        create_prolog_doc(pi, attrs);
+    } else if (name_is(target, tlen, "ox")) {
         for (; 0 != attrs->name; attrs++) {
             if (0 == strcmp("version", attrs->name)) {
                 if (0 != strcmp("1.0", attrs->value)) {
@@ -166,16 +167,16 @@ instruct(PInfo pi, const char *target, Attr attrs) {
         }
     } else {
         if (TRACE <= pi->options->trace) {
-            printf("Processing instruction %s ignored.\n", target);
+            printf("Processing instruction %.*s ignored.\n", (int)tlen, target);
         }
     }
 }
 
 static void
-nomode_instruct(PInfo pi, const char *target, Attr attrs) {
-    if (0 == strcmp("xml", target)) {
-        create_prolog_doc(pi, target, attrs);
-    } else if (0 == strcmp("ox", target)) {
+nomode_instruct(PInfo pi, const char *target, size_t tlen, Attr attrs) {
+    if (name_is(target, tlen, "xml")) {
+        create_prolog_doc(pi, attrs);
+    } else if (name_is(target, tlen, "ox")) {
         for (; 0 != attrs->name; attrs++) {
             if (0 == strcmp("version", attrs->name)) {
                 if (0 != strcmp("1.0", attrs->value)) {
@@ -199,15 +200,15 @@ nomode_instruct(PInfo pi, const char *target, Attr attrs) {
         }
     } else {
         if (TRACE <= pi->options->trace) {
-            printf("Processing instruction %s ignored.\n", target);
+            printf("Processing instruction %.*s ignored.\n", (int)tlen, target);
         }
     }
 }
 
 static void
-add_doctype(PInfo pi, const char *docType) {
+add_doctype(PInfo pi, const char *docType, size_t len) {
     VALUE       n = rb_obj_alloc(ox_doctype_clas);
-    VALUE       s = rb_str_new2(docType);
+    VALUE       s = rb_str_new(docType, len);
 
 #if HAS_ENCODING_SUPPORT
     if (0 != pi->encoding) {
@@ -222,9 +223,9 @@ add_doctype(PInfo pi, const char *docType) {
 }
 
 static void
-add_comment(PInfo pi, const char *comment) {
+add_comment(PInfo pi, const char *comment, size_t len) {
     VALUE       n = rb_obj_alloc(ox_comment_clas);
-    VALUE       s = rb_str_new2(comment);
+    VALUE       s = rb_str_new(comment, len);
 
 #if HAS_ENCODING_SUPPORT
     if (0 != pi->encoding) {
@@ -241,7 +242,7 @@ add_comment(PInfo pi, const char *comment) {
 static void
 add_cdata(PInfo pi, const char *cdata, size_t len) {
     VALUE       n = rb_obj_alloc(ox_cdata_clas);
-    VALUE       s = rb_str_new2(cdata);
+    VALUE       s = rb_str_new(cdata, len);
 
 #if HAS_ENCODING_SUPPORT
     if (0 != pi->encoding) {
@@ -256,14 +257,20 @@ add_cdata(PInfo pi, const char *cdata, size_t len) {
 }
 
 static void
-add_text(PInfo pi, char *text, int closed) {
-    VALUE       s = rb_str_new2(text);
+add_text(PInfo pi, const char *text, size_t len, int closed) {
+    VALUE       s = Qnil;
 
-#if HAS_ENCODING_SUPPORT
-    if (0 != pi->encoding) {
-        rb_enc_associate(s, pi->encoding);
+    if (Yes == pi->options->typed_text) {
+        s = ox_xsd_time_new(text, text + len);
     }
+    if (Qnil == s) {
+        s = rb_str_new(text, len);
+#if HAS_ENCODING_SUPPORT
+        if (0 != pi->encoding) {
+            rb_enc_associate(s, pi->encoding);
+        }
 #endif
+    }
     if (0 == pi->h) { // top level object
 	create_doc(pi);
     }
@@ -271,9 +278,9 @@ add_text(PInfo pi, char *text, int closed) {
 }
 
 static void
-add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
+add_element(PInfo pi, const char *ename, size_t elen, Attr attrs, int hasChildren) {
     VALUE       e;
-    VALUE       s = rb_str_new2(ename);
+    VALUE       s = rb_str_new(ename, elen);
 
 #if HAS_ENCODING_SUPPORT
     if (0 != pi->encoding) {
@@ -290,30 +297,30 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
             VALUE   *slot;
 
 	    if (Yes == pi->options->sym_keys) {
-		if (Qundef == (sym = ox_cache_get(ox_symbol_cache, attrs->name, &slot))) {
+		if (Qundef == (sym = ox_cache_getn(ox_symbol_cache, attrs->name, attrs->nlen, ox_cache_hash(attrs->name, attrs->nlen), &slot))) {
 #if HAS_ENCODING_SUPPORT
 		    if (0 != pi->encoding) {
-			VALUE	rstr = rb_str_new2(attrs->name);
+			VALUE	rstr = rb_str_new(attrs->name, attrs->nlen);
 
 			rb_enc_associate(rstr, pi->encoding);
 			sym = rb_funcall(rstr, ox_to_sym_id, 0);
 		    } else {
-			sym = ID2SYM(rb_intern(attrs->name));
+			sym = ID2SYM(rb_intern2(attrs->name, attrs->nlen));
 		    }
 #else
-		    sym = ID2SYM(rb_intern(attrs->name));
+		    sym = ID2SYM(rb_intern2(attrs->name, attrs->nlen));
 #endif
 		    *slot = sym;
 		}
 	    } else {
-		sym = rb_str_new2(attrs->name);
+		sym = rb_str_new(attrs->name, attrs->nlen);
 #if HAS_ENCODING_SUPPORT
 		if (0 != pi->encoding) {
 		    rb_enc_associate(sym, pi->encoding);
 		}
 #endif
 	    }
-            s = rb_str_new2(attrs->value);
+            s = rb_str_new(attrs->value, attrs->vlen);
 #if HAS_ENCODING_SUPPORT
             if (0 != pi->encoding) {
                 rb_enc_associate(s, pi->encoding);
@@ -339,7 +346,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 }
 
 static void
-end_element(PInfo pi, const char *ename) {
+end_element(PInfo pi, const char *ename, size_t elen) {
     if (0 != pi->h && pi->helpers <= pi->h) {
         pi->h--;
     }
@@ -38,21 +38,21 @@
 #include "ruby.h"
 #include "base64.h"
 #include "ox.h"
+#include "dtoa.h"
+#include "time_parse.h"
 
-static void     instruct(PInfo pi, const char *target, Attr attrs);
-static void     add_text(PInfo pi, char *text, int closed);
-static void     add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren);
-static void     end_element(PInfo pi, const char *ename);
+static void     instruct(PInfo pi, const char *target, size_t tlen, Attr attrs);
+static void     add_text(PInfo pi, const char *str, size_t len, int closed);
+static void     add_element(PInfo pi, const char *ename, size_t elen, Attr attrs, int hasChildren);
+static void     end_element(PInfo pi, const char *ename, size_t elen);
 
-static VALUE    parse_time(const char *text, VALUE clas);
-static VALUE    parse_xsd_time(const char *text, VALUE clas);
-static VALUE    parse_double_time(const char *text, VALUE clas);
+static VALUE    parse_time(const char *text, size_t len);
 static VALUE    parse_regexp(const char *text);
 
 static VALUE            get_var_sym_from_attrs(Attr a, void *encoding);
 static VALUE            get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class);
 static VALUE            get_class_from_attrs(Attr a, PInfo pi, VALUE base_class);
-static VALUE            classname2class(const char *name, PInfo pi, VALUE base_class);
+static VALUE            classname2class(const char *name, size_t len, PInfo pi, VALUE base_class);
 static unsigned long    get_id_from_attrs(PInfo pi, Attr a);
 static CircArray        circ_array_new(void);
 static void             circ_array_free(CircArray ca);
@@ -79,45 +79,51 @@ extern ParseCallbacks   ox_gen_callbacks;
 
 
 inline static VALUE
-str2sym(const char *str, void *encoding) {
+str2sym(const char *str, size_t len, void *encoding) {
+    VALUE	*slot;
     VALUE	sym;
     
+    if (Qundef != (sym = ox_cache_getn(ox_symbol_cache, str, len, ox_cache_hash(str, len), &slot))) {
+	return sym;
+    }
 #ifdef HAVE_RUBY_ENCODING_H
     if (0 != encoding) {
-	VALUE	rstr = rb_str_new2(str);
+	VALUE	rstr = rb_str_new(str, len);
 
 	rb_enc_associate(rstr, (rb_encoding*)encoding);
 	sym = rb_funcall(rstr, ox_to_sym_id, 0);
     } else {
-	sym = ID2SYM(rb_intern(str));
+	sym = ID2SYM(rb_intern2(str, len));
     }
 #else
-    sym = ID2SYM(rb_intern(str));
+    sym = ID2SYM(rb_intern2(str, len));
 #endif
+    *slot = sym;
+
     return sym;
 }
 
 inline static ID
-name2var(const char *name, void *encoding) {
+name2var(const char *name, size_t len, void *encoding) {
     VALUE       *slot;
     ID          var_id;
 
     if ('0' <= *name && *name <= '9') {
         var_id = INT2NUM(atoi(name));
-    } else if (Qundef == (var_id = ox_cache_get(ox_attr_cache, name, &slot))) {
+    } else if (Qundef == (var_id = ox_cache_getn(ox_attr_cache, name, len, ox_cache_hash(name, len), &slot))) {
 #ifdef HAVE_RUBY_ENCODING_H
 	if (0 != encoding) {
-	    VALUE	rstr = rb_str_new2(name);
+	    VALUE	rstr = rb_str_new(name, len);
 	    VALUE	sym;
 	    
 	    rb_enc_associate(rstr, (rb_encoding*)encoding);
 	    sym = rb_funcall(rstr, ox_to_sym_id, 0);
 	    var_id = SYM2ID(sym);
 	} else {
-	    var_id = rb_intern(name);
+	    var_id = rb_intern2(name, len);
 	}
 #else
-	var_id = rb_intern(name);
+	var_id = rb_intern2(name, len);
 #endif
         *slot = var_id;
     }
@@ -154,8 +160,8 @@ resolve_classname(VALUE mod, const char *class_name, Effort effort, VALUE base_c
 }
 
 inline static VALUE
-classname2obj(const char *name, PInfo pi, VALUE base_class) {
-    VALUE   clas = classname2class(name, pi, base_class);
+classname2obj(const char *name, size_t len, PInfo pi, VALUE base_class) {
+    VALUE   clas = classname2class(name, len, pi, base_class);
     
     if (Qundef == clas) {
         return Qnil;
@@ -205,36 +211,39 @@ parse_ulong(const char *s, PInfo pi) {
 
 // 2010-07-09T10:47:45.895826162+09:00
 inline static VALUE
-parse_time(const char *text, VALUE clas) {
+parse_time(const char *text, size_t len) {
     VALUE       t;
 
-    if (Qnil == (t = parse_double_time(text, clas)) &&
-        Qnil == (t = parse_xsd_time(text, clas))) {
+    if (Qnil == (t = ox_time_parse(text, text + len))) {
         VALUE       args[1];
 
         //printf("**** time parse\n");
-        *args = rb_str_new2(text);
+        *args = rb_str_new(text, len);
         t = rb_funcall2(ox_time_class, ox_parse_id, 1, args);
     }
     return t;
 }
 
 static VALUE
-classname2class(const char *name, PInfo pi, VALUE base_class) {
+classname2class(const char *name, size_t len, PInfo pi, VALUE base_class) {
     VALUE       *slot;
     VALUE       clas;
             
-    if (Qundef == (clas = ox_cache_get(ox_class_cache, name, &slot))) {
+    if (Qundef == (clas = ox_cache_getn(ox_class_cache, name, len, ox_cache_hash(name, len), &slot))) {
         char            class_name[1024];
         char            *s;
         const char      *n = name;
+        const char      *end = name + len;
 
+        if (sizeof(class_name) <= len) {
+            raise_error("Invalid classname, too long", pi->str, pi->s);
+        }
         clas = rb_cObject;
-        for (s = class_name; '\0' != *n; n++) {
+        for (s = class_name; n < end; n++) {
             if (':' == *n) {
                 *s = '\0';
                 n++;
-		if (':' != *n) {
+		if (end <= n || ':' != *n) {
                     raise_error("Invalid classname, expected another ':'", pi->str, pi->s);
 		}
                 if (Qundef == (clas = resolve_classname(clas, class_name, pi->options->effort, base_class))) {
@@ -257,7 +266,7 @@ static VALUE
 get_var_sym_from_attrs(Attr a, void *encoding) {
     for (; 0 != a->name; a++) {
         if ('a' == *a->name && '\0' == *(a->name + 1)) {
-            return name2var(a->value, encoding);
+            return name2var(a->value, a->vlen, encoding);
         }
     }
     return Qundef;
@@ -267,7 +276,7 @@ static VALUE
 get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class) {
     for (; 0 != a->name; a++) {
         if ('c' == *a->name && '\0' == *(a->name + 1)) {
-            return classname2obj(a->value, pi, base_class);
+            return classname2obj(a->value, a->vlen, pi, base_class);
         }
     }
     return Qundef;
@@ -289,7 +298,7 @@ static VALUE
 get_class_from_attrs(Attr a, PInfo pi, VALUE base_class) {
     for (; 0 != a->name; a++) {
         if ('c' == *a->name && '\0' == *(a->name + 1)) {
-            return classname2class(a->value, pi, base_class);
+            return classname2class(a->value, a->vlen, pi, base_class);
         }
     }
     return Qundef;
@@ -394,8 +403,8 @@ parse_regexp(const char *text) {
 }
 
 static void
-instruct(PInfo pi, const char *target, Attr attrs) {
-    if (0 == strcmp("xml", target)) {
+instruct(PInfo pi, const char *target, size_t tlen, Attr attrs) {
+    if (name_is(target, tlen, "xml")) {
 #if HAS_ENCODING_SUPPORT
         for (; 0 != attrs->name; attrs++) {
             if (0 == strcmp("encoding", attrs->name)) {
@@ -407,7 +416,12 @@ instruct(PInfo pi, const char *target, Attr attrs) {
 }
 
 static void
-add_text(PInfo pi, char *text, int closed) {
+add_text(PInfo pi, const char *str, size_t len, int closed) {
+    char		buf[256];
+    char		*cstr = buf;
+    char		*text;
+    volatile VALUE	big = Qnil; // holds long text so a raise does not leak it
+
     if (!closed) {
         raise_error("Text not closed", pi->str, pi->s);
     }
@@ -415,12 +429,10 @@ add_text(PInfo pi, char *text, int closed) {
         char    indent[128];
 
         fill_indent(pi, indent, sizeof(indent));
-        printf("%s '%s' to type %c\n", indent, text, pi->h->type);
+        printf("%s '%.*s' to type %c\n", indent, (int)len, str, pi->h->type);
     }
-    switch (pi->h->type) {
-    case NoCode:
-    case StringCode:
-        pi->h->obj = rb_str_new2(text);
+    if (NoCode == pi->h->type || StringCode == pi->h->type) {
+        pi->h->obj = rb_str_new(str, len);
 #if HAS_ENCODING_SUPPORT
         if (0 != pi->encoding) {
             rb_enc_associate(pi->h->obj, pi->encoding);
@@ -429,7 +441,18 @@ add_text(PInfo pi, char *text, int closed) {
         if (0 != pi->circ_array) {
             circ_array_set(pi->circ_array, pi->h->obj, (unsigned long)pi->id);
         }
-        break;
+        return;
+    }
+    // the other types are converted by functions that expect a terminated string
+    if (sizeof(buf) <= len) {
+        big = rb_str_new(str, len);
+        cstr = StringValuePtr(big);
+    } else {
+        memcpy(cstr, str, len);
+        cstr[len] = '\0';
+    }
+    text = cstr;
+    switch (pi->h->type) {
     case FixnumCode:
     {
         long        n = 0;
@@ -455,20 +478,11 @@ add_text(PInfo pi, char *text, int closed) {
         break;
     }
     case FloatCode:
-        pi->h->obj = rb_float_new(strtod(text, 0));
+        pi->h->obj = rb_float_new(ox_str_to_dbl(text, text + len));
         break;
     case SymbolCode:
-    {
-        VALUE   sym;
-        VALUE   *slot;
-
-        if (Qundef == (sym = ox_cache_get(ox_symbol_cache, text, &slot))) {
-	    sym = str2sym(text, pi->encoding);
-            *slot = sym;
-        }
-        pi->h->obj = sym;
+        pi->h->obj = str2sym(text, len, pi->encoding);
         break;
-    }
     case DateCode:
     {
 	VALUE	args[1];
@@ -478,7 +492,7 @@ add_text(PInfo pi, char *text, int closed) {
         break;
     }
     case TimeCode:
-        pi->h->obj = parse_time(text, ox_time_class);
+        pi->h->obj = parse_time(str, len);
         break;
     case String64Code:
     {
@@ -501,17 +515,11 @@ add_text(PInfo pi, char *text, int closed) {
     }
     case Symbol64Code:
     {
-        VALUE           sym;
-        VALUE           *slot;
         unsigned long   str_size = b64_orig_size(text);
         char            *str = ALLOCA_N(char, str_size + 1);
         
         from_base64(text, (u_char*)str);
-        if (Qundef == (sym = ox_cache_get(ox_symbol_cache, str, &slot))) {
-	    sym = str2sym(str, pi->encoding);
-            *slot = sym;
-        }
-        pi->h->obj = sym;
+        pi->h->obj = str2sym(str, str_size, pi->encoding);
         break;
     }
     case RegexpCode:
@@ -535,7 +543,7 @@ add_text(PInfo pi, char *text, int closed) {
 }
 
 static void
-add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
+add_element(PInfo pi, const char *ename, size_t elen, Attr attrs, int hasChildren) {
     Attr                a;
     Helper              h;
     unsigned long       id;
@@ -546,7 +554,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
         char    *s = buf;
         char    *end = buf + sizeof(buf) - 2;
 
-        s += snprintf(s, end - s, " <%s%s", (hasChildren) ? "" : "/", ename);
+        s += snprintf(s, end - s, " <%s%.*s", (hasChildren) ? "" : "/", (int)elen, ename);
         for (a = attrs; 0 != a->name; a++) {
             s += snprintf(s, end - s, " %s=%s", a->name, a->value);
         }
@@ -567,7 +575,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
     } else {
         pi->h++;
     }
-    if ('\0' != ename[1]) {
+    if (1 != elen) {
         raise_error("Invalid element name", pi->str, pi->s);
     }
     h = pi->h;
@@ -627,7 +635,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
         break;
     case RawCode:
         if (hasChildren) {
-            h->obj = ox_parse(pi->s, ox_gen_callbacks, &pi->s, pi->options);
+            h->obj = ox_parse(pi->s, pi->end - pi->s, ox_gen_callbacks, &pi->s, pi->options);
             if (0 != pi->circ_array) {
                 circ_array_set(pi->circ_array, h->obj, get_id_from_attrs(pi, attrs));
             }
@@ -679,18 +687,18 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 }
 
 static void
-end_element(PInfo pi, const char *ename) {
+end_element(PInfo pi, const char *ename, size_t elen) {
     if (TRACE <= pi->options->trace) {
         char    indent[128];
         
         if (DEBUG <= pi->options->trace) {
             char    buf[1024];
 
-            snprintf(buf, sizeof(buf) - 1, "</%s>", ename);
+            snprintf(buf, sizeof(buf) - 1, "</%.*s>", (int)elen, ename);
             debug_stack(pi, buf);
         } else {
             fill_indent(pi, indent, sizeof(indent));
-            printf("%s</%s>\n", indent, ename);
+            printf("%s</%.*s>\n", indent, (int)elen, ename);
         }
     }
     if (0 != pi->h && pi->helpers <= pi->h) {
@@ -784,94 +792,6 @@ end_element(PInfo pi, const char *ename) {
     }
 }
 
-static VALUE
-parse_double_time(const char *text, VALUE clas) {
-    long        v = 0;
-    long        v2 = 0;
-    const char  *dot = 0;
-    char        c;
-    
-    for (; '.' != *text; text++) {
-        c = *text;
-        if (c < '0' || '9' < c) {
-            return Qnil;
-        }
-        v = 10 * v + (long)(c - '0');
-    }
-    dot = text++;
-    for (; '\0' != *text && text - dot <= 6; text++) {
-        c = *text;
-        if (c < '0' || '9' < c) {
-            return Qnil;
-        }
-        v2 = 10 * v2 + (long)(c - '0');
-    }
-    for (; text - dot <= 9; text++) {
-        v2 *= 10;
-    }
-#if HAS_NANO_TIME
-    return rb_time_nano_new(v, v2);
-#else
-    return rb_time_new(v, v2 / 1000);
-#endif
-}
-
-typedef struct _Tp {
-    int         cnt;
-    char        end;
-    char        alt;
-} *Tp;
-
-static VALUE
-parse_xsd_time(const char *text, VALUE clas) {
-    long        cargs[10];
-    long        *cp = cargs;
-    long        v;
-    int         i;
-    char        c;
-    struct _Tp  tpa[10] = { { 4, '-', '-' },
-                           { 2, '-', '-' },
-                           { 2, 'T', 'T' },
-                           { 2, ':', ':' },
-                           { 2, ':', ':' },
-                           { 2, '.', '.' },
-                           { 9, '+', '-' },
-                           { 2, ':', ':' },
-                           { 2, '\0', '\0' },
-                           { 0, '\0', '\0' } };
-    Tp          tp = tpa;
-    struct tm   tm;
-
-    for (; 0 != tp->cnt; tp++) {
-        for (i = tp->cnt, v = 0; 0 < i ; text++, i--) {
-            c = *text;
-            if (c < '0' || '9' < c) {
-                if (tp->end == c || tp->alt == c) {
-                    break;
-                }
-                return Qnil;
-            }
-            v = 10 * v + (long)(c - '0');
-        }
-        c = *text++;
-        if (tp->end != c && tp->alt != c) {
-            return Qnil;
-        }
-        *cp++ = v;
-    }
-    tm.tm_year = (int)cargs[0] - 1900;
-    tm.tm_mon = (int)cargs[1] - 1;
-    tm.tm_mday = (int)cargs[2];
-    tm.tm_hour = (int)cargs[3];
-    tm.tm_min = (int)cargs[4];
-    tm.tm_sec = (int)cargs[5];
-#if HAS_NANO_TIME
-    return rb_time_nano_new(mktime(&tm), cargs[6]);
-#else
-    return rb_time_new(mktime(&tm), cargs[6] / 1000);
-#endif
-}
-
 // debug functions
 static void
 fill_indent(PInfo pi, char *buf, size_t size) {
@@ -32,9 +32,16 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "ruby.h"
 #include "ox.h"
+#include "filter.h"
 
 // maximum to allocate on the stack, arbitrary limit
 #define SMALL_XML	65536
@@ -44,6 +51,15 @@ typedef struct _YesNoOpt {
     char	*attr;
 } *YesNoOpt;
 
+// arguments for loads that must release the xml with rb_ensure()
+typedef struct _LoadArgs {
+    const char	*xml;
+    size_t	len;
+    int		argc;
+    VALUE	*argv;
+    VALUE	self;
+} *LoadArgs;
+
 void Init_ox();
 
 VALUE	 Ox = Qnil;
@@ -61,6 +77,7 @@ ID	ox_doctype_id;
 ID	ox_end_element_id;
 ID	ox_end_id;
 ID	ox_error_id;
+ID	ox_events_id;
 ID	ox_excl_id;
 ID	ox_fileno_id;
 ID	ox_inspect_id;
@@ -85,6 +102,7 @@ ID	ox_tv_sec_id;
 ID	ox_tv_nsec_id;
 ID	ox_tv_usec_id;
 ID	ox_value_id;
+ID	ox_write_id;
 
 VALUE	ox_encoding_sym;
 
@@ -106,23 +124,42 @@ Cache	ox_symbol_cache = 0;
 Cache	ox_class_cache = 0;
 Cache	ox_attr_cache = 0;
 
+static unsigned long	cache_limit = 100000;
+static VALUE		cache_marker = Qnil;
+static VALUE		dumper_class;
+
+static VALUE	attribute_sym;
 static VALUE	auto_define_sym;
 static VALUE	auto_sym;
+static VALUE	batch_sym;
+static VALUE	buffer_growth_sym;
+static VALUE	buffer_size_sym;
+static VALUE	bytes_sym;
+static VALUE	class_sym;
 static VALUE	circular_sym;
 static VALUE	convert_special_sym;
 static VALUE	effort_sym;
+static VALUE	evictions_sym;
+static VALUE	filter_sym;
 static VALUE	generic_sym;
+static VALUE	hits_sym;
 static VALUE	indent_sym;
+static VALUE	limit_sym;
 static VALUE	limited_sym;
+static VALUE	max_buffer_size_sym;
+static VALUE	misses_sym;
 static VALUE	mode_sym;
 static VALUE	object_sym;
 static VALUE	opt_format_sym;
 static VALUE	optimized_sym;
+static VALUE	size_sym;
 static VALUE	strict_sym;
 static VALUE	strict_sym;
+static VALUE	symbol_sym;
 static VALUE	symbolize_keys_sym;
 static VALUE	tolerant_sym;
 static VALUE	trace_sym;
+static VALUE	typed_text_sym;
 static VALUE	with_dtd_sym;
 static VALUE	with_instruct_sym;
 static VALUE	with_xml_sym;
@@ -139,7 +176,8 @@ struct _Options	 ox_default_options = {
     No,			// xsd_date
     NoMode,		// mode
     StrictEffort,	// effort
-    Yes			// sym_keys
+    Yes,		// sym_keys
+    No			// typed_text
 };
 
 extern ParseCallbacks	ox_obj_callbacks;
@@ -163,6 +201,7 @@ static void	parse_dump_options(VALUE ropts, Options copts);
  * - mode: [:object|:generic|:limited|nil] load method to use for XML
  * - effort: [:strict|:tolerant|:auto_define] set the tolerance level for loading
  * - symbolize_keys: [true|false|nil] symbolize element attribute keys or leave as Strings
+ * - typed_text: [true|false|nil] load text that is an xsd:dateTime as a Time in generic and limited mode
  * @return [Hash] all current option settings.
  */
 static VALUE
@@ -179,6 +218,7 @@ get_def_opts(VALUE self) {
     rb_hash_aset(opts, circular_sym, (Yes == ox_default_options.circular) ? Qtrue : ((No == ox_default_options.circular) ? Qfalse : Qnil));
     rb_hash_aset(opts, xsd_date_sym, (Yes == ox_default_options.xsd_date) ? Qtrue : ((No == ox_default_options.xsd_date) ? Qfalse : Qnil));
     rb_hash_aset(opts, symbolize_keys_sym, (Yes == ox_default_options.sym_keys) ? Qtrue : ((No == ox_default_options.sym_keys) ? Qfalse : Qnil));
+    rb_hash_aset(opts, typed_text_sym, (Yes == ox_default_options.typed_text) ? Qtrue : ((No == ox_default_options.typed_text) ? Qfalse : Qnil));
     switch (ox_default_options.mode) {
     case ObjMode:	rb_hash_aset(opts, mode_sym, object_sym);	break;
     case GenMode:	rb_hash_aset(opts, mode_sym, generic_sym);	break;
@@ -211,6 +251,7 @@ get_def_opts(VALUE self) {
  * @param [:object|:generic|:limited|nil] :mode load method to use for XML
  * @param [:strict|:tolerant|:auto_define] :effort set the tolerance level for loading
  * @param [true|false|nil] :symbolize_keys symbolize element attribute keys or leave as Strings
+ * @param [true|false|nil] :typed_text load text that is an xsd:dateTime as a Time in generic and limited mode
  * @return [nil]
  */
 static VALUE
@@ -222,6 +263,7 @@ set_def_opts(VALUE self, VALUE opts) {
 	{ xsd_date_sym, &ox_default_options.xsd_date },
 	{ circular_sym, &ox_default_options.circular },
 	{ symbolize_keys_sym, &ox_default_options.sym_keys },
+	{ typed_text_sym, &ox_default_options.typed_text },
 	{ Qnil, 0 }
     };
     YesNoOpt	o;
@@ -289,6 +331,17 @@ set_def_opts(VALUE self, VALUE opts) {
     return Qnil;
 }
 
+/* The parser does not modify the xml so it is read in place from a frozen
+ * String that shares the buffer in case a callback changes the original. The
+ * caller keeps the returned String on the stack while parsing.
+ */
+static VALUE
+xml_to_parse(VALUE ruby_xml) {
+    Check_Type(ruby_xml, T_STRING);
+
+    return rb_str_new_frozen(ruby_xml);
+}
+
 /* call-seq: parse_obj(xml) => Object
  *
  * Parses an XML document String that is in the object format and returns an
@@ -301,24 +354,9 @@ set_def_opts(VALUE self, VALUE opts) {
  */
 static VALUE
 to_obj(VALUE self, VALUE ruby_xml) {
-    char	*xml;
-    size_t	len;
-    VALUE	obj;
+    volatile VALUE	xml = xml_to_parse(ruby_xml);
 
-    Check_Type(ruby_xml, T_STRING);
-    // the xml string gets modified so make a copy of it
-    len = RSTRING_LEN(ruby_xml) + 1;
-    if (SMALL_XML < len) {
-	xml = ALLOC_N(char, len);
-    } else {
-	xml = ALLOCA_N(char, len);
-    }
-    strcpy(xml, StringValuePtr(ruby_xml));
-    obj = ox_parse(xml, ox_obj_callbacks, 0, &ox_default_options);
-    if (SMALL_XML < len) {
-	xfree(xml);
-    }
-    return obj;
+    return ox_parse(RSTRING_PTR(xml), RSTRING_LEN(xml), ox_obj_callbacks, 0, &ox_default_options);
 }
 
 /* call-seq: parse(xml) => Ox::Document or Ox::Element
@@ -330,28 +368,13 @@ to_obj(VALUE self, VALUE ruby_xml) {
  */
 static VALUE
 to_gen(VALUE self, VALUE ruby_xml) {
-    char		*xml;
-    size_t		len;
-    VALUE		obj;
+    volatile VALUE	xml = xml_to_parse(ruby_xml);
 
-    Check_Type(ruby_xml, T_STRING);
-    // the xml string gets modified so make a copy of it
-    len = RSTRING_LEN(ruby_xml) + 1;
-    if (SMALL_XML < len) {
-	xml = ALLOC_N(char, len);
-    } else {
-	xml = ALLOCA_N(char, len);
-    }
-    strcpy(xml, StringValuePtr(ruby_xml));
-    obj = ox_parse(xml, ox_gen_callbacks, 0, &ox_default_options);
-    if (SMALL_XML < len) {
-	xfree(xml);
-    }
-    return obj;
+    return ox_parse(RSTRING_PTR(xml), RSTRING_LEN(xml), ox_gen_callbacks, 0, &ox_default_options);
 }
 
 static VALUE
-load(char *xml, int argc, VALUE *argv, VALUE self) {
+load(const char *xml, size_t len, int argc, VALUE *argv, VALUE self) {
     VALUE		obj;
     struct _Options	options = ox_default_options;
     
@@ -390,22 +413,25 @@ load(char *xml, int argc, VALUE *argv, VALUE self) {
 	if (Qnil != (v = rb_hash_lookup(h, symbolize_keys_sym))) {
 	    options.sym_keys = (Qfalse == v) ? No : Yes;
 	}
+	if (Qnil != (v = rb_hash_lookup(h, typed_text_sym))) {
+	    options.typed_text = (Qtrue == v) ? Yes : No;
+	}
     }
     switch (options.mode) {
     case ObjMode:
-	obj = ox_parse(xml, ox_obj_callbacks, 0, &options);
+	obj = ox_parse(xml, len, ox_obj_callbacks, 0, &options);
 	break;
     case GenMode:
-	obj = ox_parse(xml, ox_gen_callbacks, 0, &options);
+	obj = ox_parse(xml, len, ox_gen_callbacks, 0, &options);
 	break;
     case LimMode:
-	obj = ox_parse(xml, ox_limited_callbacks, 0, &options);
+	obj = ox_parse(xml, len, ox_limited_callbacks, 0, &options);
 	break;
     case NoMode:
-	obj = ox_parse(xml, ox_nomode_callbacks, 0, &options);
+	obj = ox_parse(xml, len, ox_nomode_callbacks, 0, &options);
 	break;
     default:
-	obj = ox_parse(xml, ox_gen_callbacks, 0, &options);
+	obj = ox_parse(xml, len, ox_gen_callbacks, 0, &options);
 	break;
     }
     return obj;
@@ -428,28 +454,65 @@ load(char *xml, int argc, VALUE *argv, VALUE self) {
  *  - *:auto_define* - auto define missing classes and modules
  * @param [Fixnum] :trace trace level as a Fixnum, default: 0 (silent)
  * @param [true|false|nil] :symbolize_keys symbolize element attribute keys or leave as Strings
+ * @param [true|false] :typed_text load text that is an xsd:dateTime as a Time in generic and limited mode
  */
 static VALUE
 load_str(int argc, VALUE *argv, VALUE self) {
-    char	*xml;
-    size_t	len;
-    VALUE	obj;
-    
-    Check_Type(*argv, T_STRING);
-    // the xml string gets modified so make a copy of it
-    len = RSTRING_LEN(*argv) + 1;
-    if (SMALL_XML < len) {
-	xml = ALLOC_N(char, len);
-    } else {
-	xml = ALLOCA_N(char, len);
+    volatile VALUE	xml = xml_to_parse(*argv);
+
+    return load(RSTRING_PTR(xml), RSTRING_LEN(xml), argc - 1, argv + 1, self);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static VALUE
+load_args(VALUE a) {
+    LoadArgs	args = (LoadArgs)a;
+
+    return load(args->xml, args->len, args->argc, args->argv, args->self);
+}
+
+static VALUE
+unmap_file(VALUE a) {
+    LoadArgs	args = (LoadArgs)a;
+
+    munmap((void*)args->xml, args->len);
+
+    return Qnil;
+}
+
+/* Maps the file read-only and parses it in place. The pages are shared with
+ * the file system cache so the file is not copied. Qundef is returned if the
+ * file can not be mapped so it is read instead.
+ */
+static VALUE
+load_mapped_file(const char *path, int argc, VALUE *argv, VALUE self) {
+    struct _LoadArgs	args;
+    struct stat		st;
+    int			fd;
+
+    if (0 > (fd = open(path, O_RDONLY))) {
+	rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
-    strcpy(xml, StringValuePtr(*argv));
-    obj = load(xml, argc - 1, argv + 1, self);
-    if (SMALL_XML < len) {
-	xfree(xml);
+    if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || 0 == st.st_size) {
+	close(fd);
+	return Qundef;
     }
-    return obj;
+    args.len = (size_t)st.st_size;
+    args.xml = (const char*)mmap(0, args.len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == (void*)args.xml) {
+	return Qundef;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise((void*)args.xml, args.len, MADV_SEQUENTIAL);
+#endif
+    args.argc = argc;
+    args.argv = argv;
+    args.self = self;
+
+    return rb_ensure(load_args, (VALUE)&args, unmap_file, (VALUE)&args);
 }
+#endif
 
 /* call-seq: load_file(file_path, options) => Ox::Document or Ox::Element or Object
  *
@@ -468,6 +531,7 @@ load_str(int argc, VALUE *argv, VALUE self) {
  *  - *:auto_define* - auto define missing classes and modules
  * @param [Fixnum] :trace trace level as a Fixnum, default: 0 (silent)
  * @param [true|false|nil] :symbolize_keys symbolize element attribute keys or leave as Strings
+ * @param [true|false] :typed_text load text that is an xsd:dateTime as a Time in generic and limited mode
  */
 static VALUE
 load_file(int argc, VALUE *argv, VALUE self) {
@@ -479,15 +543,20 @@ load_file(int argc, VALUE *argv, VALUE self) {
     
     Check_Type(*argv, T_STRING);
     path = StringValuePtr(*argv);
+#ifdef HAVE_SYS_MMAN_H
+    if (Qundef != (obj = load_mapped_file(path, argc - 1, argv + 1, self))) {
+	return obj;
+    }
+#endif
     if (0 == (f = fopen(path, "r"))) {
 	rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
     fseek(f, 0, SEEK_END);
     len = ftell(f);
     if (SMALL_XML < len) {
-	xml = ALLOC_N(char, len + 1);
+	xml = ALLOC_N(char, len);
     } else {
-	xml = ALLOCA_N(char, len + 1);
+	xml = ALLOCA_N(char, len);
     }
     fseek(f, 0, SEEK_SET);
     if (len != fread(xml, 1, len, f)) {
@@ -495,8 +564,7 @@ load_file(int argc, VALUE *argv, VALUE self) {
 	rb_raise(rb_eLoadError, "Failed to read %ld bytes from %s.\n", (long)len, path);
     }
     fclose(f);
-    xml[len] = '\0';
-    obj = load(xml, argc - 1, argv + 1, self);
+    obj = load(xml, len, argc - 1, argv + 1, self);
     if (SMALL_XML < len) {
 	xfree(xml);
     }
@@ -507,15 +575,59 @@ load_file(int argc, VALUE *argv, VALUE self) {
  *
  * Parses an IO stream or file containing an XML document. Raises an exception
  * if the XML is malformed or the classes specified are not valid.
+ *
+ * A String or the String in a StringIO is parsed where it is instead of
+ * being copied into a read buffer a piece at a time. The handler may change
+ * the String without affecting the parse.
+ *
+ * An IO for a regular file larger than the read buffer is mapped into memory
+ * from its current position and parsed in place as well. The file is left
+ * positioned at the end. Pipes and sockets are read as before.
+ *
+ * With the :batch option the handler callbacks are not made one at a time.
+ * Events are collected into a flat Array of [method, arg, arg2] triples,
+ * padded with nil, and the Array is passed to the handler's events() method
+ * once it holds :batch events and again at the end of the document. Only the
+ * events for which the handler has the usual callback method public are
+ * collected. The Array is reused so it must not be kept after events()
+ * returns. Ox::Sax::Value objects are only valid during a callback so value()
+ * and attr_value() are not used in batch mode, text() and attr() are used
+ * instead. Errors are passed to error() as they occur, after the events
+ * before them have been delivered.
+ *
+ * The :filter option limits the events to those inside the elements at the
+ * given paths. A path such as "/table/row/cell" lists the element names
+ * from the top element down and a * step matches any name. The selected
+ * elements and everything in them are reported as usual. Nothing outside of
+ * them is reported and elements that can not lead to a selected element are
+ * skipped over without reading their contents in detail.
+ *
+ * When reading from an IO the document is read into a buffer that grows by
+ * :buffer_growth when a single token such as a long text does not fit. Once
+ * the oversized token has been passed the buffer goes back to :buffer_size.
+ * If a token does not fit in :max_buffer_size an IOError is raised instead of
+ * growing the buffer further.
  * @param [Ox::Sax] handler SAX (responds to OX::Sax methods) like handler
- * @param [IO|String] io IO Object to read from
+ * @param [IO|String] io IO Object or String to read from
  * @param [Hash] options parse options
  * @param [true|false] :convert_special flag indicating special special characters like &lt; are converted
+ * @param [Fixnum] :batch number of events to deliver per call to the handler's events() method
+ * @param [String|Array] :filter element path or paths to report events for
+ * @param [Fixnum] :buffer_size initial size of the read buffer, default 64 KB
+ * @param [Fixnum|Float] :buffer_growth factor the read buffer grows by when a token does not fit, default 2
+ * @param [Fixnum] :max_buffer_size size the read buffer may not grow past, default no limit
  */
 static VALUE
 sax_parse(int argc, VALUE *argv, VALUE self) {
-    int convert = 0;
+    struct _SaxOptions	options;
+    VALUE		filter = Qnil;
 
+    options.convert_special = 0;
+    options.batch = 0;
+    options.filter = 0;
+    options.buffer_size = 0;
+    options.buffer_growth = 2.0;
+    options.max_buffer_size = 0;
     if (argc < 2) {
 	rb_raise(rb_eArgError, "Wrong number of arguments to sax_parse.\n");
     }
@@ -524,10 +636,39 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
 	VALUE	v;
 	
 	if (Qnil != (v = rb_hash_lookup(h, convert_special_sym))) {
-	    convert = (Qtrue == v);
+	    options.convert_special = (Qtrue == v);
+	}
+	if (Qnil != (v = rb_hash_lookup(h, batch_sym))) {
+	    if (rb_cFixnum != rb_obj_class(v) || NUM2LONG(v) < 1) {
+		rb_raise(rb_eArgError, ":batch must be a positive Fixnum.\n");
+	    }
+	    options.batch = NUM2LONG(v);
+	}
+	if (Qnil != (v = rb_hash_lookup(h, filter_sym))) {
+	    filter = ox_filter_new(v, &options.filter);
+	}
+	if (Qnil != (v = rb_hash_lookup(h, buffer_size_sym))) {
+	    if (rb_cFixnum != rb_obj_class(v) || NUM2LONG(v) < 16) {
+		rb_raise(rb_eArgError, ":buffer_size must be a Fixnum of at least 16.\n");
+	    }
+	    options.buffer_size = NUM2LONG(v);
+	}
+	if (Qnil != (v = rb_hash_lookup(h, buffer_growth_sym))) {
+	    if ((rb_cFixnum != rb_obj_class(v) && rb_cFloat != rb_obj_class(v)) || NUM2DBL(v) < 1.5) {
+		rb_raise(rb_eArgError, ":buffer_growth must be a number of at least 1.5.\n");
+	    }
+	    options.buffer_growth = NUM2DBL(v);
+	}
+	if (Qnil != (v = rb_hash_lookup(h, max_buffer_size_sym))) {
+	    if (rb_cFixnum != rb_obj_class(v) || NUM2LONG(v) < 16 ||
+		(0 < options.buffer_size && NUM2LONG(v) < options.buffer_size)) {
+		rb_raise(rb_eArgError, ":max_buffer_size must be a Fixnum no smaller than the :buffer_size.\n");
+	    }
+	    options.max_buffer_size = NUM2LONG(v);
 	}
     }
-    ox_sax_parse(argv[0], argv[1], convert);
+    ox_sax_parse(argv[0], argv[1], &options);
+    RB_GC_GUARD(filter); // owns options.filter
 
     return Qnil;
 }
@@ -593,9 +734,14 @@ parse_dump_options(VALUE ropts, Options copts) {
  }
 
 /* call-seq: dump(obj, options) => xml-string
+ *             dump(obj, io, options) => nil
  *
- * Dumps an Object (obj) to a string.
+ * Dumps an Object (obj) to a string. If an IO, or anything else that
+ * responds to write(), is given the document is written to it in chunks as
+ * it is built instead and nil is returned. Memory use then stays the same no
+ * matter how big the document is.
  * @param [Object] obj Object to serialize as an XML document String
+ * @param [IO] io optional destination for the XML document
  * @param [Hash] options formating options
  * @param [Fixnum] :indent format expected
  * @param [true|false] :xsd_date use XSD date format if true, default: false
@@ -606,30 +752,113 @@ parse_dump_options(VALUE ropts, Options copts) {
  */
 static VALUE
 dump(int argc, VALUE *argv, VALUE self) {
-    char		*xml;
     struct _Options	copts = ox_default_options;
-    VALUE		rstr;
     
+    if (3 == argc) {
+	parse_dump_options(argv[2], &copts);
+    }
+    if (2 <= argc && T_HASH != rb_type(argv[1])) {
+	if (!rb_respond_to(argv[1], ox_write_id)) {
+	    rb_raise(rb_eArgError, "Expected an IO or an options Hash.\n");
+	}
+	ox_write_obj_to_io(*argv, argv[1], &copts, 0);
+
+	return Qnil;
+    }
     if (2 == argc) {
 	parse_dump_options(argv[1], &copts);
     }
-    if (0 == (xml = ox_write_obj_to_str(*argv, &copts))) {
-	rb_raise(rb_eNoMemError, "Not enough memory.\n");
+    return ox_write_obj_to_str(*argv, &copts, OX_DUMP_CHUNK_SIZE);
+}
+
+typedef struct _Dumper {
+    struct _Options	opts;
+    struct _DumpBuf	buf;	// window used for IO dumps, kept between dumps
+    size_t		last;	// length of the last String dump, 0 if none yet
+} *Dumper;
+
+static void
+dumper_free(void *ptr) {
+    Dumper	d = (Dumper)ptr;
+
+    if (0 != d->buf.buf) {
+	xfree(d->buf.buf);
     }
-    rstr = rb_str_new2(xml);
-#if HAS_ENCODING_SUPPORT
-    if ('\0' != *copts.encoding) {
-	rb_enc_associate(rstr, rb_enc_find(copts.encoding));
+    xfree(d);
+}
+
+static VALUE
+dumper_alloc(VALUE clas) {
+    Dumper	d = ALLOC(struct _Dumper);
+
+    d->opts = ox_default_options;
+    d->buf.buf = 0;
+    d->buf.size = 0;
+    d->last = 0;
+
+    return Data_Wrap_Struct(clas, 0, dumper_free, d);
+}
+
+/* call-seq: new(options)
+ *
+ * Creates a Dumper that dumps with the given options. The options are the
+ * same as for Ox.dump() and are merged with the default options when the
+ * Dumper is created. A Dumper is meant to be kept and used for many dumps of
+ * similar Objects. Each String dump starts with room for a little more than
+ * the previous document so the String is usually the right size from the
+ * start and never has to be grown or copied. Dumps to an IO reuse the same
+ * buffer each time.
+ * @param [Hash] options formating options
+ */
+static VALUE
+dumper_init(int argc, VALUE *argv, VALUE self) {
+    Dumper	d;
+
+    Data_Get_Struct(self, struct _Dumper, d);
+    if (1 == argc) {
+	parse_dump_options(*argv, &d->opts);
     }
-#endif
-    xfree(xml);
+    return self;
+}
+
+/* call-seq: dump(obj) => xml-string
+ *             dump(obj, io) => nil
+ *
+ * Dumps an Object (obj) to a String or, if an IO is given, writes it to the
+ * IO and returns nil.
+ * @param [Object] obj Object to serialize as an XML document String
+ * @param [IO] io optional destination for the XML document
+ */
+static VALUE
+dumper_dump(int argc, VALUE *argv, VALUE self) {
+    Dumper	d;
+    VALUE	rstr;
+    size_t	size;
+
+    if (1 > argc || 2 < argc) {
+	rb_raise(rb_eArgError, "wrong number of arguments (%d for 1 or 2)\n", argc);
+    }
+    Data_Get_Struct(self, struct _Dumper, d);
+    if (2 == argc) {
+	if (!rb_respond_to(argv[1], ox_write_id)) {
+	    rb_raise(rb_eArgError, "Expected an IO.\n");
+	}
+	ox_write_obj_to_io(*argv, argv[1], &d->opts, &d->buf);
+
+	return Qnil;
+    }
+    // a little room over the last size so the same document does not have to grow
+    size = (0 == d->last) ? OX_DUMP_CHUNK_SIZE : d->last + d->last / 8 + 1024;
+    rstr = ox_write_obj_to_str(*argv, &d->opts, size);
+    d->last = RSTRING_LEN(rstr);
 
     return rstr;
 }
 
 /* call-seq: to_file(file_path, obj, options)
  *
- * Dumps an Object to the specified file.
+ * Dumps an Object to the specified file. The document is written as it is
+ * built so memory use stays the same no matter how big the document is.
  * @param [String] file_path file path to write the XML document to
  * @param [Object] obj Object to serialize as an XML document String
  * @param [Hash] options formating options
@@ -653,6 +882,98 @@ to_file(int argc, VALUE *argv, VALUE self) {
     return Qnil;
 }
 
+static VALUE
+cache_stats_hash(Cache cache) {
+    struct _CacheStats	stats;
+    VALUE		h = rb_hash_new();
+
+    ox_cache_stats(cache, &stats);
+    rb_hash_aset(h, size_sym, ULONG2NUM(stats.cnt));
+    rb_hash_aset(h, limit_sym, ULONG2NUM(stats.limit));
+    rb_hash_aset(h, hits_sym, ULONG2NUM(stats.hits));
+    rb_hash_aset(h, misses_sym, ULONG2NUM(stats.misses));
+    rb_hash_aset(h, evictions_sym, ULONG2NUM(stats.evictions));
+    rb_hash_aset(h, bytes_sym, ULONG2NUM(stats.bytes));
+
+    return h;
+}
+
+/* call-seq: cache_stats() => Hash
+ *
+ * Returns the state of the caches the parsers use for element names, class
+ * names and attribute names. The Hash has a :symbol, :class and :attribute
+ * entry, each a Hash of
+ * - size: [Fixnum] number of names in the cache
+ * - limit: [Fixnum] maximum number of names or 0 for no limit
+ * - hits: [Fixnum] lookups that found the name
+ * - misses: [Fixnum] lookups that added the name
+ * - evictions: [Fixnum] names dropped to stay within the limit
+ * - bytes: [Fixnum] memory used by the cache
+ * @return [Hash] cache statistics
+ */
+static VALUE
+cache_stats(VALUE self) {
+    VALUE	h = rb_hash_new();
+
+    rb_hash_aset(h, symbol_sym, cache_stats_hash(ox_symbol_cache));
+    rb_hash_aset(h, class_sym, cache_stats_hash(ox_class_cache));
+    rb_hash_aset(h, attribute_sym, cache_stats_hash(ox_attr_cache));
+
+    return h;
+}
+
+/* call-seq: cache_limit() => Fixnum
+ *
+ * Returns the maximum number of names kept in each cache. 0 means no limit.
+ */
+static VALUE
+get_cache_limit(VALUE self) {
+    return ULONG2NUM(cache_limit);
+}
+
+/* call-seq: cache_limit=(limit)
+ *
+ * Sets the maximum number of names kept in each cache. Once a cache is full
+ * names that have not been used recently are dropped to make room for new
+ * ones. A limit of 0 lets the caches grow without bound. The default is
+ * 100000.
+ * @param [Fixnum] limit maximum number of names in each cache
+ */
+static VALUE
+set_cache_limit(VALUE self, VALUE limit) {
+    Check_Type(limit, T_FIXNUM);
+    if (FIX2LONG(limit) < 0) {
+	rb_raise(rb_eArgError, "cache_limit must be 0 or more.\n");
+    }
+    cache_limit = FIX2ULONG(limit);
+    ox_cache_limit(ox_symbol_cache, cache_limit);
+    ox_cache_limit(ox_class_cache, cache_limit);
+    ox_cache_limit(ox_attr_cache, cache_limit);
+
+    return limit;
+}
+
+/* call-seq: clear_caches()
+ *
+ * Empties the element, class and attribute name caches and frees the memory
+ * they use. The hit and miss counts are kept.
+ */
+static VALUE
+clear_caches(VALUE self) {
+    ox_cache_clear(ox_symbol_cache);
+    ox_cache_clear(ox_class_cache);
+    ox_cache_clear(ox_attr_cache);
+
+    return Qnil;
+}
+
+// The attribute cache holds IDs which are not objects so it is not marked.
+static void
+mark_caches(void *ptr) {
+    ox_cache_mark(ox_symbol_cache);
+    ox_cache_mark(ox_class_cache);
+}
+
 extern void	ox_cache_test(void);
 
 static VALUE
@@ -686,6 +1007,11 @@ void Init_ox() {
     rb_define_module_function(Ox, "load_file", load_file, -1);
     rb_define_module_function(Ox, "to_file", to_file, -1);
 
+    rb_define_module_function(Ox, "cache_stats", cache_stats, 0);
+    rb_define_module_function(Ox, "cache_limit", get_cache_limit, 0);
+    rb_define_module_function(Ox, "cache_limit=", set_cache_limit, 1);
+    rb_define_module_function(Ox, "clear_caches", clear_caches, 0);
+
     rb_require("time");
     rb_require("date");
     rb_require("stringio");
@@ -703,6 +1029,7 @@ void Init_ox() {
     ox_end_element_id = rb_intern("end_element");
     ox_end_id = rb_intern("@end");
     ox_error_id = rb_intern("error");
+    ox_events_id = rb_intern("events");
     ox_excl_id = rb_intern("@excl");
     ox_fileno_id = rb_intern("fileno");
     ox_inspect_id = rb_intern("inspect");
@@ -721,6 +1048,7 @@ void Init_ox() {
     ox_string_id = rb_intern("string");
     ox_text_id = rb_intern("text");
     ox_value_id = rb_intern("value");
+    ox_write_id = rb_intern("write");
     ox_to_c_id = rb_intern("to_c");
     ox_to_s_id = rb_intern("to_s");
     ox_to_sym_id = rb_intern("to_sym");
@@ -733,23 +1061,38 @@ void Init_ox() {
     ox_struct_class = rb_const_get(rb_cObject, rb_intern("Struct"));
     ox_stringio_class = rb_const_get(rb_cObject, rb_intern("StringIO"));
 
+    attribute_sym = ID2SYM(rb_intern("attribute"));		rb_gc_register_address(&attribute_sym);
     auto_define_sym = ID2SYM(rb_intern("auto_define"));		rb_gc_register_address(&auto_define_sym);
     auto_sym = ID2SYM(rb_intern("auto"));			rb_gc_register_address(&auto_sym);
+    batch_sym = ID2SYM(rb_intern("batch"));			rb_gc_register_address(&batch_sym);
+    buffer_growth_sym = ID2SYM(rb_intern("buffer_growth"));	rb_gc_register_address(&buffer_growth_sym);
+    buffer_size_sym = ID2SYM(rb_intern("buffer_size"));		rb_gc_register_address(&buffer_size_sym);
+    bytes_sym = ID2SYM(rb_intern("bytes"));			rb_gc_register_address(&bytes_sym);
+    class_sym = ID2SYM(rb_intern("class"));			rb_gc_register_address(&class_sym);
     circular_sym = ID2SYM(rb_intern("circular"));		rb_gc_register_address(&circular_sym);
     convert_special_sym = ID2SYM(rb_intern("convert_special")); rb_gc_register_address(&convert_special_sym);
     effort_sym = ID2SYM(rb_intern("effort"));			rb_gc_register_address(&effort_sym);
+    evictions_sym = ID2SYM(rb_intern("evictions"));		rb_gc_register_address(&evictions_sym);
+    filter_sym = ID2SYM(rb_intern("filter"));			rb_gc_register_address(&filter_sym);
     generic_sym = ID2SYM(rb_intern("generic"));			rb_gc_register_address(&generic_sym);
+    hits_sym = ID2SYM(rb_intern("hits"));			rb_gc_register_address(&hits_sym);
     indent_sym = ID2SYM(rb_intern("indent"));			rb_gc_register_address(&indent_sym);
+    limit_sym = ID2SYM(rb_intern("limit"));			rb_gc_register_address(&limit_sym);
     limited_sym = ID2SYM(rb_intern("limited"));			rb_gc_register_address(&limited_sym);
+    max_buffer_size_sym = ID2SYM(rb_intern("max_buffer_size"));	rb_gc_register_address(&max_buffer_size_sym);
+    misses_sym = ID2SYM(rb_intern("misses"));			rb_gc_register_address(&misses_sym);
     mode_sym = ID2SYM(rb_intern("mode"));			rb_gc_register_address(&mode_sym);
     object_sym = ID2SYM(rb_intern("object"));			rb_gc_register_address(&object_sym);
     opt_format_sym = ID2SYM(rb_intern("opt_format"));		rb_gc_register_address(&opt_format_sym);
     optimized_sym = ID2SYM(rb_intern("optimized"));		rb_gc_register_address(&optimized_sym);
+    size_sym = ID2SYM(rb_intern("size"));			rb_gc_register_address(&size_sym);
     ox_encoding_sym = ID2SYM(rb_intern("encoding"));		rb_gc_register_address(&ox_encoding_sym);
     strict_sym = ID2SYM(rb_intern("strict"));			rb_gc_register_address(&strict_sym);
+    symbol_sym = ID2SYM(rb_intern("symbol"));			rb_gc_register_address(&symbol_sym);
     symbolize_keys_sym = ID2SYM(rb_intern("symbolize_keys"));	rb_gc_register_address(&symbolize_keys_sym);
     tolerant_sym = ID2SYM(rb_intern("tolerant"));		rb_gc_register_address(&tolerant_sym);
     trace_sym = ID2SYM(rb_intern("trace"));			rb_gc_register_address(&trace_sym);
+    typed_text_sym = ID2SYM(rb_intern("typed_text"));		rb_gc_register_address(&typed_text_sym);
     with_dtd_sym = ID2SYM(rb_intern("with_dtd"));		rb_gc_register_address(&with_dtd_sym);
     with_instruct_sym = ID2SYM(rb_intern("with_instructions")); rb_gc_register_address(&with_instruct_sym);
     with_xml_sym = ID2SYM(rb_intern("with_xml"));		rb_gc_register_address(&with_xml_sym);
@@ -768,9 +1111,19 @@ void Init_ox() {
     ox_cache_new(&ox_symbol_cache);
     ox_cache_new(&ox_class_cache);
     ox_cache_new(&ox_attr_cache);
+    ox_cache_limit(ox_symbol_cache, cache_limit);
+    ox_cache_limit(ox_class_cache, cache_limit);
+    ox_cache_limit(ox_attr_cache, cache_limit);
+    cache_marker = Data_Wrap_Struct(rb_cObject, mark_caches, 0, 0);
+    rb_gc_register_address(&cache_marker);
 
     ox_sax_define();
 
+    dumper_class = rb_define_class_under(Ox, "Dumper", rb_cObject);
+    rb_define_alloc_func(dumper_class, dumper_alloc);
+    rb_define_method(dumper_class, "initialize", dumper_init, -1);
+    rb_define_method(dumper_class, "dump", dumper_dump, -1);
+
     rb_define_module_function(Ox, "cache_test", cache_test, 0);
     rb_define_module_function(Ox, "cache8_test", cache8_test, 0);
 }
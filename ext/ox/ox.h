@@ -59,8 +59,16 @@ enum st_retval {ST_CONTINUE = 0, ST_STOP = 1, ST_DELETE = 2, ST_CHECK};
 
 #include "cache.h"
 
+#ifndef RB_GC_GUARD
+// older Rubies do not have it
+#define RB_GC_GUARD(v)	(*(volatile VALUE*)&(v))
+#endif
+
 #define raise_error(msg, xml, current) _ox_raise_error(msg, xml, current, __FILE__, __LINE__)
 
+// true if the len characters at str are the string literal name
+#define name_is(str, len, name)	(sizeof(name) - 1 == (len) && 0 == memcmp(str, name, sizeof(name) - 1))
+
 #define MAX_TEXT_LEN	4096
 #define MAX_ATTRS	1024
 #define MAX_DEPTH	1024
@@ -147,6 +155,8 @@ typedef enum {
 typedef struct _Attr {
     const char	*name;
     const char	*value;
+    size_t	nlen;
+    size_t	vlen;
 } *Attr;
 
 typedef struct _Helper {
@@ -157,14 +167,18 @@ typedef struct _Helper {
 
 typedef struct _PInfo	*PInfo;
 
+/* Strings passed to the callbacks are not terminated, use the lengths. The
+ * exception is the attributes which are also '\0' terminated. None of them
+ * are valid after the callback returns.
+ */
 typedef struct _ParseCallbacks {
-    void	(*instruct)(PInfo pi, const char *target, Attr attrs);
-    void	(*add_doctype)(PInfo pi, const char *docType);
-    void	(*add_comment)(PInfo pi, const char *comment);
+    void	(*instruct)(PInfo pi, const char *target, size_t tlen, Attr attrs);
+    void	(*add_doctype)(PInfo pi, const char *docType, size_t len);
+    void	(*add_comment)(PInfo pi, const char *comment, size_t len);
     void	(*add_cdata)(PInfo pi, const char *cdata, size_t len);
-    void	(*add_text)(PInfo pi, char *text, int closed);
-    void	(*add_element)(PInfo pi, const char *ename, Attr attrs, int hasChildren);
-    void	(*end_element)(PInfo pi, const char *ename);
+    void	(*add_text)(PInfo pi, const char *text, size_t len, int closed);
+    void	(*add_element)(PInfo pi, const char *ename, size_t elen, Attr attrs, int hasChildren);
+    void	(*end_element)(PInfo pi, const char *ename, size_t elen);
 } *ParseCallbacks;
 
 typedef struct _CircArray {
@@ -186,14 +200,38 @@ typedef struct _Options {
     char	mode;		// LoadMode
     char	effort;		// Effort
     char	sym_keys;	// symbolize keys
+    char	typed_text;	// YesNo, load date-time text as a Time in generic mode
 } *Options;
 
+#define OX_DUMP_CHUNK_SIZE	65325
+
+// A dump buffer kept between calls so it can be reused.
+typedef struct _DumpBuf {
+    char	*buf;
+    size_t	size;
+} *DumpBuf;
+
+typedef struct _SaxOptions {
+    int		convert_special;	// convert &lt; and friends in text and attributes
+    long	batch;			// events per call to the handler's events(), 0 for a call per event
+    struct _Filter	*filter;		// element paths to report events for, 0 for all
+    long	buffer_size;		// initial read buffer size, 0 for the default
+    double	buffer_growth;		// read buffer growth factor
+    long	max_buffer_size;	// largest the read buffer may grow to, 0 for no limit
+} *SaxOptions;
+
 /* parse information structure */
 struct _PInfo {
     struct _Helper	helpers[MAX_DEPTH];
     Helper		h;		/* current helper or 0 if not set */
-    char		*str;		/* buffer being read from */
-    char		*s;		/* current position in buffer */
+    const char		*str;		/* buffer being read from */
+    const char		*s;		/* current position in buffer */
+    const char		*end;		/* end of the buffer */
+    const char		**endp;		/* where to store the end of the first element, if not 0 */
+    char		*buf;		/* scratch for decoded text and attributes */
+    char		*buf_end;
+    char		*tail;		/* end of the used part of buf */
+    char		base_buf[MAX_TEXT_LEN];
     VALUE		obj;
     ParseCallbacks	pcb;
     CircArray		circ_array;
@@ -206,15 +244,16 @@ struct _PInfo {
     Options		options;
 };
 
-extern VALUE	ox_parse(char *xml, ParseCallbacks pcb, char **endp, Options options);
+extern VALUE	ox_parse(const char *xml, size_t len, ParseCallbacks pcb, const char **endp, Options options);
 extern void	_ox_raise_error(const char *msg, const char *xml, const char *current, const char* file, int line);
 
-extern void	ox_sax_parse(VALUE handler, VALUE io, int convert);
+extern void	ox_sax_parse(VALUE handler, VALUE io, SaxOptions options);
 extern void	ox_sax_define(void);
 
 
-extern char*	ox_write_obj_to_str(VALUE obj, Options copts);
+extern VALUE	ox_write_obj_to_str(VALUE obj, Options copts, size_t size);
 extern void	ox_write_obj_to_file(VALUE obj, const char *path, Options copts);
+extern void	ox_write_obj_to_io(VALUE obj, VALUE io, Options copts, DumpBuf keep);
 
 extern struct _Options	ox_default_options;
 
@@ -233,6 +272,7 @@ extern ID	ox_doctype_id;
 extern ID	ox_end_element_id;
 extern ID	ox_end_id;
 extern ID	ox_error_id;
+extern ID	ox_events_id;
 extern ID	ox_excl_id;
 extern ID	ox_fileno_id;
 extern ID	ox_inspect_id;
@@ -257,6 +297,7 @@ extern ID	ox_tv_sec_id;
 extern ID	ox_tv_nsec_id;
 extern ID	ox_tv_usec_id;
 extern ID	ox_value_id;
+extern ID	ox_write_id;
 
 extern VALUE	ox_date_class;
 extern VALUE	ox_empty_string;
@@ -28,6 +28,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
@@ -35,183 +36,251 @@
 
 #include "ruby.h"
 #include "ox.h"
-
-static void	read_instruction(PInfo pi);
-static void	read_doctype(PInfo pi);
-static void	read_comment(PInfo pi);
-static void	read_element(PInfo pi);
-static void	read_text(PInfo pi);
-//static void	  read_reduced_text(PInfo pi);
-static void	read_cdata(PInfo pi);
-static char*	read_name_token(PInfo pi);
-static char*	read_quoted_value(PInfo pi);
-static int	read_coded_char(PInfo pi);
-static void	next_non_white(PInfo pi);
-static int	collapse_special(char *str);
-
-/* This XML parser is a single pass, destructive, callback parser. It is a
+#include "scan.h"
+
+static void		read_instruction(PInfo pi);
+static void		read_doctype(PInfo pi);
+static void		read_comment(PInfo pi);
+static void		read_element(PInfo pi);
+static void		read_text(PInfo pi);
+static void		read_cdata(PInfo pi);
+static void		read_attr(PInfo pi, Attr a, int decode);
+static const char*	read_name_token(PInfo pi);
+static const char*	read_quoted_value(PInfo pi, size_t *lenp);
+static int		read_coded_char(const char **sp, const char *end);
+static void		next_non_white(PInfo pi);
+static void		collapse_special(PInfo pi, const char *s, const char *end);
+
+/* This XML parser is a single pass, non-destructive, callback parser. It is a
  * single pass parse since it only make one pass over the characters in the
- * XML document string. It is destructive because it re-uses the content of
- * the string for values in the callback and places \0 characters at various
- * places to mark the end of tokens and strings. It is a callback parser like
- * a SAX parser because it uses callback when document elements are
- * encountered.
+ * XML document string. The document is given as a pointer and a length. It
+ * does not have to be terminated and it is never written to so it can be
+ * read-only memory such as a mapped file or a frozen String. It is a callback
+ * parser like a SAX parser because it uses callback when document elements
+ * are encountered.
+ *
+ * Tokens are passed to the callbacks as a pointer and a length. Names and
+ * text point into the document unless special characters had to be decoded
+ * in which case they are in the scratch buffer of the PInfo. Attributes are
+ * always copied to the scratch buffer and are '\0' terminated as well.
  *
  * Parsing is very tolerant. Lack of headers and even mispelled element
  * endings are passed over without raising an error. A best attempt is made in
  * all cases to parse the string.
  */
 
+#define at_end(pi)	((pi)->end <= (pi)->s)
+
 inline static void
 next_non_white(PInfo pi) {
-    for (; 1; pi->s++) {
-	switch(*pi->s) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	    break;
-	default:
-	    return;
-	}
-    }
+    pi->s = ox_skip_white(pi->s, pi->end);
 }
 
 inline static void
 next_white(PInfo pi) {
-    for (; 1; pi->s++) {
-	switch(*pi->s) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	case '\0':
-	    return;
-	default:
+    pi->s = ox_scan_white(pi->s, pi->end);
+}
+
+inline static int
+starts_with(PInfo pi, const char *str, size_t len) {
+    return (len <= (size_t)(pi->end - pi->s) && 0 == memcmp(pi->s, str, len));
+}
+
+// Returns the first occurrence of pat in the buffer or 0 if not found.
+static const char*
+find_str(const char *s, const char *end, const char *pat, size_t plen) {
+    if ((size_t)(end - s) < plen) {
+	return 0;
+    }
+    for (end -= plen - 1; s < end; s++) {
+	if (end <= (s = ox_scan_char(s, end, *pat))) {
 	    break;
 	}
+	if (0 == memcmp(s, pat, plen)) {
+	    return s;
+	}
     }
+    return 0;
 }
 
-VALUE
-ox_parse(char *xml, ParseCallbacks pcb, char **endp, Options options) {
-    struct _PInfo	pi;
-    int			body_read = 0;
+static void
+buf_grow(PInfo pi, size_t len) {
+    size_t	size = pi->buf_end - pi->buf;
+    size_t	pos = pi->tail - pi->buf;
 
-    if (0 == xml) {
-	raise_error("Invalid arg, xml string can not be null", xml, 0);
+    while (size < pos + len) {
+	size *= 2;
     }
-    if (DEBUG <= options->trace) {
-	printf("Parsing xml:\n%s\n", xml);
+    if (pi->base_buf == pi->buf) {
+	pi->buf = ALLOC_N(char, size);
+	memcpy(pi->buf, pi->base_buf, pos);
+    } else {
+	REALLOC_N(pi->buf, char, size);
     }
-    /* initialize parse info */
-    pi.str = xml;
-    pi.s = xml;
-    pi.h = 0;
-    pi.pcb = pcb;
-    pi.obj = Qnil;
-    pi.circ_array = 0;
-    pi.encoding = 0;
-    pi.options = options;
+    pi->buf_end = pi->buf + size;
+    pi->tail = pi->buf + pos;
+}
+
+inline static void
+buf_append(PInfo pi, const char *s, size_t len) {
+    if (pi->buf_end < pi->tail + len) {
+	buf_grow(pi, len);
+    }
+    memcpy(pi->tail, s, len);
+    pi->tail += len;
+}
+
+inline static void
+buf_append_char(PInfo pi, char c) {
+    if (pi->buf_end <= pi->tail) {
+	buf_grow(pi, 1);
+    }
+    *pi->tail++ = c;
+}
+
+static VALUE
+parse_doc(VALUE ppi) {
+    PInfo	pi = (PInfo)ppi;
+    int		body_read = 0;
+
     while (1) {
-	next_non_white(&pi);	// skip white space
-	if ('\0' == *pi.s) {
+	next_non_white(pi);	// skip white space
+	if (at_end(pi)) {
 	    break;
 	}
-	if (body_read && 0 != endp) {
-	    *endp = pi.s;
+	if (body_read && 0 != pi->endp) {
+	    *pi->endp = pi->s;
 	    break;
 	}
-	if ('<' != *pi.s) {		// all top level entities start with <
-	    raise_error("invalid format, expected <", pi.str, pi.s);
+	if ('<' != *pi->s) {		// all top level entities start with <
+	    raise_error("invalid format, expected <", pi->str, pi->s);
 	}
-	pi.s++;		// past <
-	switch (*pi.s) {
+	pi->s++;		// past <
+	if (at_end(pi)) {
+	    raise_error("invalid format, document not terminated", pi->str, pi->s);
+	}
+	switch (*pi->s) {
 	case '?':	// prolog
-	    pi.s++;
-	    read_instruction(&pi);
+	    pi->s++;
+	    read_instruction(pi);
 	    break;
 	case '!':	/* comment or doctype */
-	    pi.s++;
-	    if ('\0' == *pi.s) {
-		raise_error("invalid format, DOCTYPE or comment not terminated", pi.str, pi.s);
-	    } else if ('-' == *pi.s) {
-		pi.s++;	// skip -
-		if ('-' != *pi.s) {
-		    raise_error("invalid format, bad comment format", pi.str, pi.s);
+	    pi->s++;
+	    if (at_end(pi)) {
+		raise_error("invalid format, DOCTYPE or comment not terminated", pi->str, pi->s);
+	    } else if ('-' == *pi->s) {
+		pi->s++;	// skip -
+		if (at_end(pi) || '-' != *pi->s) {
+		    raise_error("invalid format, bad comment format", pi->str, pi->s);
 		} else {
-		    pi.s++;	// skip second -
-		    read_comment(&pi);
+		    pi->s++;	// skip second -
+		    read_comment(pi);
 		}
-	    } else if (0 == strncmp("DOCTYPE", pi.s, 7)) {
-		pi.s += 7;
-		read_doctype(&pi);
+	    } else if (starts_with(pi, "DOCTYPE", 7)) {
+		pi->s += 7;
+		read_doctype(pi);
 	    } else {
-		raise_error("invalid format, DOCTYPE or comment expected", pi.str, pi.s);
+		raise_error("invalid format, DOCTYPE or comment expected", pi->str, pi->s);
 	    }
 	    break;
-	case '\0':
-	    raise_error("invalid format, document not terminated", pi.str, pi.s);
 	default:
-	    read_element(&pi);
+	    read_element(pi);
 	    body_read = 1;
 	    break;
 	}
     }
+    return Qnil;
+}
+
+/* The scratch buffer is freed even when a parse error or a callback raises.
+ */
+static VALUE
+parse_cleanup(VALUE ppi) {
+    PInfo	pi = (PInfo)ppi;
+
+    if (pi->base_buf != pi->buf) {
+	xfree(pi->buf);
+    }
+    return Qnil;
+}
+
+VALUE
+ox_parse(const char *xml, size_t len, ParseCallbacks pcb, const char **endp, Options options) {
+    struct _PInfo	pi;
+
+    if (0 == xml) {
+	raise_error("Invalid arg, xml string can not be null", xml, 0);
+    }
+    if (DEBUG <= options->trace) {
+	printf("Parsing xml:\n%.*s\n", (int)len, xml);
+    }
+    /* initialize parse info */
+    pi.str = xml;
+    pi.s = xml;
+    pi.end = xml + len;
+    pi.endp = endp;
+    pi.buf = pi.base_buf;
+    pi.buf_end = pi.base_buf + sizeof(pi.base_buf);
+    pi.tail = pi.buf;
+    pi.h = 0;
+    pi.pcb = pcb;
+    pi.obj = Qnil;
+    pi.circ_array = 0;
+    pi.encoding = 0;
+    pi.options = options;
+    rb_ensure(parse_doc, (VALUE)&pi, parse_cleanup, (VALUE)&pi);
+
     return pi.obj;
 }
 
+/* The attributes are appended to the scratch buffer as they are read and the
+ * buffer may move when it grows so the name and value pointers are set once
+ * all of them have been read.
+ */
+static void
+fix_attrs(PInfo pi, Attr a) {
+    const char	*s = pi->buf;
+
+    for (; 0 != a->name; a++) {
+	a->name = s;
+	s += a->nlen + 1;
+	a->value = s;
+	s += a->vlen + 1;
+    }
+}
+
 /* Entered after the "<?" sequence. Ready to read the rest.
  */
 static void
 read_instruction(PInfo pi) {
     struct _Attr	attrs[MAX_ATTRS + 1];
     Attr		a = attrs;
-    char		*target;
-    char		*end;
-    char		c;
-	
-    memset(attrs, 0, sizeof(attrs));
+    const char		*target;
+    size_t		tlen;
+
     target = read_name_token(pi);
-    end = pi->s;
+    tlen = pi->s - target;
     next_non_white(pi);
-    c = *pi->s;
-    *end = '\0'; // terminate name
-    if ('?' != c) {
-	while ('?' != *pi->s) {
-	    if ('\0' == *pi->s) {
-		raise_error("invalid format, processing instruction not terminated", pi->str, pi->s);
-	    }
-	    next_non_white(pi);
-	    a->name = read_name_token(pi);
-	    end = pi->s;
-	    next_non_white(pi);
-	    if ('=' != *pi->s++) {
-		raise_error("invalid format, no attribute value", pi->str, pi->s);
-	    }
-	    *end = '\0'; // terminate name
-	    // read value
-	    next_non_white(pi);
-	    a->value = read_quoted_value(pi);
-	    a++;
-	    if (MAX_ATTRS <= (a - attrs)) {
-		raise_error("too many attributes", pi->str, pi->s);
-	    }
-	    next_non_white(pi);
+    pi->tail = pi->buf;
+    while (at_end(pi) || '?' != *pi->s) {
+	if (at_end(pi)) {
+	    raise_error("invalid format, processing instruction not terminated", pi->str, pi->s);
 	}
-	if ('?' == *pi->s) {
-	    pi->s++;
+	read_attr(pi, a, 0);
+	a++;
+	if (MAX_ATTRS <= (a - attrs)) {
+	    raise_error("too many attributes", pi->str, pi->s);
 	}
-    } else {
-	pi->s++;
+	next_non_white(pi);
     }
-    if ('>' != *pi->s++) {
+    pi->s++; // past ?
+    if (at_end(pi) || '>' != *pi->s++) {
 	raise_error("invalid format, processing instruction not terminated", pi->str, pi->s);
     }
+    a->name = 0;
+    fix_attrs(pi, attrs);
     if (0 != pi->pcb->instruct) {
-	pi->pcb->instruct(pi, target, attrs);
+	pi->pcb->instruct(pi, target, tlen, attrs);
     }
 }
 
@@ -220,17 +289,19 @@ read_instruction(PInfo pi) {
  */
 static void
 read_doctype(PInfo pi) {
-    char	*docType;
+    const char	*docType;
+    size_t	len;
     int		depth = 1;
     char	c;
 
     next_non_white(pi);
     docType = pi->s;
     while (1) {
-	c = *pi->s++;
-	if ('\0' == c) {
+	if (at_end(pi)) {
 	    raise_error("invalid format, prolog not terminated", pi->str, pi->s);
-	} else if ('<' == c) {
+	}
+	c = *pi->s++;
+	if ('<' == c) {
 	    depth++;
 	} else if ('>' == c) {
 	    depth--;
@@ -240,10 +311,10 @@ read_doctype(PInfo pi) {
 	    }
 	}
     }
-    *pi->s = '\0';
+    len = pi->s - docType;
     pi->s++;
     if (0 != pi->pcb->add_doctype) {
-	pi->pcb->add_doctype(pi, docType);
+	pi->pcb->add_doctype(pi, docType, len);
     }
 }
 
@@ -251,35 +322,19 @@ read_doctype(PInfo pi) {
  */
 static void
 read_comment(PInfo pi) {
-    char	*end;
-    char	*s;
-    char	*comment;
-    int		done = 0;
-    
+    const char	*end;
+    const char	*comment;
+
     next_non_white(pi);
     comment = pi->s;
-    end = strstr(pi->s, "-->");
-    if (0 == end) {
+    if (0 == (end = find_str(pi->s, pi->end, "-->", 3))) {
 	raise_error("invalid format, comment not terminated", pi->str, pi->s);
     }
-    for (s = end - 1; pi->s < s && !done; s--) {
-	switch(*s) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	    break;
-	default:
-	    *(s + 1) = '\0';
-	    done = 1;
-	    break;
-	}
-    }
-    *end = '\0'; // in case the comment was blank
     pi->s = end + 3;
+    for (; comment < end && scan_is(*(end - 1), SCAN_WHITE); end--) {
+    }
     if (0 != pi->pcb->add_comment) {
-	pi->pcb->add_comment(pi, comment);
+	pi->pcb->add_comment(pi, comment, end - comment);
     }
 }
 
@@ -290,380 +345,256 @@ static void
 read_element(PInfo pi) {
     struct _Attr	attrs[MAX_ATTRS];
     Attr		ap = attrs;
-    char		*name;
-    char		*ename;
-    char		*end;
-    char		c;
-    long		elen;
-    int			hasChildren = 0;
+    const char		*name;
+    const char		*ename;
+    size_t		elen;
     int			done = 0;
 
     ename = read_name_token(pi);
-    end = pi->s;
-    elen = end - ename;
+    elen = pi->s - ename;
     next_non_white(pi);
-    c = *pi->s;
-    *end = '\0';
-    if ('/' == c) {
-	/* empty element, no attributes and no children */
-	pi->s++;
-	if ('>' != *pi->s) {
-	    //printf("*** '%s' ***\n", pi->s);
-	    raise_error("invalid format, element not closed", pi->str, pi->s);
-	}
-	pi->s++;	/* past > */
-	ap->name = 0;
-	pi->pcb->add_element(pi, ename, attrs, hasChildren);
-	pi->pcb->end_element(pi, ename);
-
-	return;
-    }
+    pi->tail = pi->buf;
     /* read attribute names until the close (/ or >) is reached */
     while (!done) {
-	if ('\0' == c) {
-	    next_non_white(pi);
-	    c = *pi->s;
-	}
-	switch (c) {
-	case '\0':
+	if (at_end(pi)) {
 	    raise_error("invalid format, document not terminated", pi->str, pi->s);
+	}
+	switch (*pi->s) {
 	case '/':
-	    // Element with just attributes.
+	    // Element with no children, possibly with attributes.
 	    pi->s++;
-	    if ('>' != *pi->s) {
+	    if (at_end(pi) || '>' != *pi->s) {
 		raise_error("invalid format, element not closed", pi->str, pi->s);
 	    }
 	    pi->s++;
 	    ap->name = 0;
-	    pi->pcb->add_element(pi, ename, attrs, hasChildren);
-	    pi->pcb->end_element(pi, ename);
+	    fix_attrs(pi, attrs);
+	    pi->pcb->add_element(pi, ename, elen, attrs, 0);
+	    pi->pcb->end_element(pi, ename, elen);
 
 	    return;
 	case '>':
 	    // has either children or a value
 	    pi->s++;
-	    hasChildren = 1;
 	    done = 1;
 	    ap->name = 0;
-	    pi->pcb->add_element(pi, ename, attrs, hasChildren);
+	    fix_attrs(pi, attrs);
+	    pi->pcb->add_element(pi, ename, elen, attrs, 1);
 	    break;
 	default:
 	    // Attribute name so it's an element and the attribute will be
 	    // added to it.
-	    ap->name = read_name_token(pi);
-	    end = pi->s;
-	    next_non_white(pi);
-	    if ('=' != *pi->s++) {
-		raise_error("invalid format, no attribute value", pi->str, pi->s);
-	    }
-	    *end = '\0'; // terminate name
-	    // read value
-	    next_non_white(pi);
-	    ap->value = read_quoted_value(pi);
-	    if (0 != strchr(ap->value, '&')) {
-		if (0 != collapse_special((char*)ap->value)) {
-		    raise_error("invalid format, special character does not end with a semicolon", pi->str, pi->s);
-		}
-	    }
+	    read_attr(pi, ap, 1);
 	    ap++;
 	    if (MAX_ATTRS <= (ap - attrs)) {
 		raise_error("too many attributes", pi->str, pi->s);
 	    }
-	    break;
-	}
-	c = '\0';
-    }
-    if (hasChildren) {
-	char	*start;
-	
-	done = 0;
-	// read children
-	while (!done) {
-	    start = pi->s;
 	    next_non_white(pi);
-	    c = *pi->s++;
-	    if ('\0' == c) {
-		raise_error("invalid format, document not terminated", pi->str, pi->s);
-	    }
-	    if ('<' == c) {
-		switch (*pi->s) {
-		case '!':	/* better be a comment or CDATA */
-		    pi->s++;
-		    if ('-' == *pi->s && '-' == *(pi->s + 1)) {
-			pi->s += 2;
-			read_comment(pi);
-		    } else if (0 == strncmp("[CDATA[", pi->s, 7)) {
-			pi->s += 7;
-			read_cdata(pi);
-		    } else {
-			raise_error("invalid format, invalid comment or CDATA format", pi->str, pi->s);
-		    }
-		    break;
-		case '/':
-		    pi->s++;
-		    name = read_name_token(pi);
-		    end = pi->s;
-		    next_non_white(pi);
-		    c = *pi->s;
-		    *end = '\0';
-		    if (0 != strcmp(name, ename)) {
-			raise_error("invalid format, elements overlap", pi->str, pi->s);
-		    }
-		    if ('>' != c) {
-			raise_error("invalid format, element not closed", pi->str, pi->s);
-		    }
-		    pi->s++;
-		    pi->pcb->end_element(pi, ename);
-		    return;
-		case '\0':
-		    raise_error("invalid format, document not terminated", pi->str, pi->s);
-		default:
-		    // a child element
-		    read_element(pi);
-		    break;
-		}
-	    } else {	// read as TEXT
-		pi->s = start;
-		//pi->s--;
-		read_text(pi);
-		//read_reduced_text(pi);
-
-		// to exit read_text with no errors the next character must be <
-		if ('/' == *(pi->s + 1) &&
-		    0 == strncmp(ename, pi->s + 2, elen) &&
-		    '>' == *(pi->s + elen + 2)) {
-		    // close tag after text so treat as a value
-		    pi->s += elen + 3;
-		    pi->pcb->end_element(pi, ename);
-		    return;
-		}
-	    }
+	    break;
 	}
     }
-}
-
-static void
-read_text(PInfo pi) {
-    char	buf[MAX_TEXT_LEN];
-    char	*b = buf;
-    char	*alloc_buf = 0;
-    char	*end = b + sizeof(buf) - 2;
-    char	c;
-    int		done = 0;
+    // read children
+    while (1) {
+	const char	*start = pi->s;
 
-    while (!done) {
-	c = *pi->s++;
-	switch(c) {
-	case '<':
-	    done = 1;
-	    pi->s--;
-	    break;
-	case '\0':
+	next_non_white(pi);
+	if (at_end(pi)) {
 	    raise_error("invalid format, document not terminated", pi->str, pi->s);
-	default:
-	    if ('&' == c) {
-		c = read_coded_char(pi);
+	}
+	if ('<' == *pi->s) {
+	    pi->s++;
+	    if (at_end(pi)) {
+		raise_error("invalid format, document not terminated", pi->str, pi->s);
 	    }
-	    if (end <= b) {
-		unsigned long	size;
-		
-		if (0 == alloc_buf) {
-		    size = sizeof(buf) * 2;
-		    alloc_buf = ALLOC_N(char, size);
-		    memcpy(alloc_buf, buf, b - buf);
-		    b = alloc_buf + (b - buf);
+	    switch (*pi->s) {
+	    case '!':	/* better be a comment or CDATA */
+		pi->s++;
+		if (starts_with(pi, "--", 2)) {
+		    pi->s += 2;
+		    read_comment(pi);
+		} else if (starts_with(pi, "[CDATA[", 7)) {
+		    pi->s += 7;
+		    read_cdata(pi);
 		} else {
-		    unsigned long	pos = b - alloc_buf;
-
-		    size = (end - alloc_buf) * 2;
-		    REALLOC_N(alloc_buf, char, size);
-		    b = alloc_buf + pos;
+		    raise_error("invalid format, invalid comment or CDATA format", pi->str, pi->s);
 		}
-		end = alloc_buf + size - 2;
+		break;
+	    case '/':
+		pi->s++;
+		name = read_name_token(pi);
+		if ((size_t)(pi->s - name) != elen || 0 != memcmp(name, ename, elen)) {
+		    raise_error("invalid format, elements overlap", pi->str, pi->s);
+		}
+		next_non_white(pi);
+		if (at_end(pi) || '>' != *pi->s) {
+		    raise_error("invalid format, element not closed", pi->str, pi->s);
+		}
+		pi->s++;
+		pi->pcb->end_element(pi, ename, elen);
+		return;
+	    default:
+		// a child element
+		read_element(pi);
+		break;
+	    }
+	} else {	// read as TEXT
+	    pi->s = start;
+	    read_text(pi);
+	    // to exit read_text with no errors the next character must be <
+	    if (pi->s + elen + 3 <= pi->end &&
+		'/' == *(pi->s + 1) &&
+		0 == memcmp(ename, pi->s + 2, elen) &&
+		'>' == *(pi->s + elen + 2)) {
+		// close tag after text so treat as a value
+		pi->s += elen + 3;
+		pi->pcb->end_element(pi, ename, elen);
+		return;
 	    }
-	    *b++ = c;
-	    break;
 	}
     }
-    *b = '\0';
-    if (0 != alloc_buf) {
-	pi->pcb->add_text(pi, alloc_buf, ('/' == *(pi->s + 1)));
-	xfree(alloc_buf);
-    } else {
-	pi->pcb->add_text(pi, buf, ('/' == *(pi->s + 1)));
-    }
 }
 
-#if 0
+/* Text without special characters is passed to the callback where it sits in
+ * the document. Otherwise it is decoded into the scratch buffer.
+ */
 static void
-read_reduced_text(PInfo pi) {
-    char	buf[MAX_TEXT_LEN];
-    char	*b = buf;
-    char	*alloc_buf = 0;
-    char	*end = b + sizeof(buf) - 2;
-    char	c;
-    int		spc = 0;
-    int		done = 0;
-
-    while (!done) {
-	c = *pi->s++;
-	switch(c) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	    spc = 1;
-	    break;
-	case '<':
-	    done = 1;
-	    pi->s--;
-	    break;
-	case '\0':
-	    raise_error("invalid format, document not terminated", pi->str, pi->s);
-	default:
-	    if ('&' == c) {
-		c = read_coded_char(pi);
-	    }
-	    if (end <= b + spc) {
-		unsigned long	size;
-		
-		if (0 == alloc_buf) {
-		    size = sizeof(buf) * 2;
-		    alloc_buf = ALLOC_N(char, size);
-		    memcpy(alloc_buf, buf, b - buf);
-		    b = alloc_buf + (b - buf);
-		} else {
-		    unsigned long	pos = b - alloc_buf;
-
-		    size = (end - alloc_buf) * 2;
-		    REALLOC(alloc_buf, char, size);
-		    b = alloc_buf + pos;
-		}
-		end = alloc_buf + size - 2;
-	    }
-	    if (spc) {
-		*b++ = ' ';
-	    }
-	    spc = 0;
-	    *b++ = c;
-	    break;
+read_text(PInfo pi) {
+    const char	*text = pi->s;
+    const char	*start;
+    size_t	len;
+
+    pi->s = ox_scan_text(pi->s, pi->end);
+    if (!at_end(pi) && '&' == *pi->s) {
+	pi->tail = pi->buf;
+	buf_append(pi, text, pi->s - text);
+	while (!at_end(pi) && '&' == *pi->s) {
+	    pi->s++;
+	    buf_append_char(pi, (char)read_coded_char(&pi->s, pi->end));
+	    start = pi->s;
+	    pi->s = ox_scan_text(pi->s, pi->end);
+	    buf_append(pi, start, pi->s - start);
 	}
-    }
-    *b = '\0';
-    if (0 != alloc_buf) {
-	pi->pcb->add_text(pi, alloc_buf, ('/' == *(pi->s + 1)));
-	xfree(alloc_buf);
+	text = pi->buf;
+	len = pi->tail - pi->buf;
     } else {
-	pi->pcb->add_text(pi, buf, ('/' == *(pi->s + 1)));
+	len = pi->s - text;
+    }
+    if (at_end(pi)) {
+	raise_error("invalid format, document not terminated", pi->str, pi->s);
     }
+    pi->pcb->add_text(pi, text, len, (pi->s + 1 < pi->end && '/' == *(pi->s + 1)));
 }
-#endif
 
-static char*
+static const char*
 read_name_token(PInfo pi) {
-    char	*start;
+    const char	*start;
 
     next_non_white(pi);
     start = pi->s;
-    for (; 1; pi->s++) {
-	switch (*pi->s) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '?':
-	case '=':
-	case '/':
-	case '>':
-	case '\n':
-	case '\r':
-	    return start;
-	case '\0':
-	    // documents never terminate after a name token
-	    raise_error("invalid format, document not terminated", pi->str, pi->s);
-	    break; // to avoid warnings
-	default:
-	    break;
-	}
+    pi->s = ox_scan_name(pi->s, pi->end);
+    if (at_end(pi)) {
+	// documents never terminate after a name token
+	raise_error("invalid format, document not terminated", pi->str, pi->s);
     }
     return start;
 }
 
+/* Reads an attribute and appends the name and value, each followed by a '\0',
+ * to the scratch buffer. The lengths are set in the Attr and the name is set
+ * to mark the Attr as used. fix_attrs() sets the pointers.
+ */
+static void
+read_attr(PInfo pi, Attr a, int decode) {
+    const char	*value;
+    size_t	vlen;
+
+    a->name = read_name_token(pi);
+    a->nlen = pi->s - a->name;
+    next_non_white(pi);
+    if (at_end(pi) || '=' != *pi->s++) {
+	raise_error("invalid format, no attribute value", pi->str, pi->s);
+    }
+    buf_append(pi, a->name, a->nlen);
+    buf_append_char(pi, '\0');
+    // read value
+    next_non_white(pi);
+    value = read_quoted_value(pi, &vlen);
+    if (decode && 0 != memchr(value, '&', vlen)) {
+	size_t	pos = pi->tail - pi->buf;
+
+	collapse_special(pi, value, value + vlen);
+	a->vlen = pi->tail - pi->buf - pos;
+    } else {
+	buf_append(pi, value, vlen);
+	a->vlen = vlen;
+    }
+    buf_append_char(pi, '\0');
+}
+
 static void
 read_cdata(PInfo pi) {
-    char	*start;
-    char	*end;
+    const char	*start;
+    const char	*end;
 
     start = pi->s;
-    end = strstr(pi->s, "]]>");
+    end = find_str(pi->s, pi->end, "]]>", 3);
     if (end == 0) {
 	raise_error("invalid format, CDATA not terminated", pi->str, pi->s);
     }
-    *end = '\0';
     pi->s = end + 3;
     if (0 != pi->pcb->add_cdata) {
 	pi->pcb->add_cdata(pi, start, end - start);
     }
 }
 
-inline static void
-next_non_token(PInfo pi) {
-    for (; 1; pi->s++) {
-	switch(*pi->s) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	case '/':
-	case '>':
-	    return;
-	default:
-	    break;
-	}
-    }
-}
-
 /* Assume the value starts immediately and goes until the quote character is
  * reached again. Do not read the character after the terminating quote.
  */
-static char*
-read_quoted_value(PInfo pi) {
-    char	*value = 0;
-    
+static const char*
+read_quoted_value(PInfo pi, size_t *lenp) {
+    const char	*value = 0;
+
+    if (at_end(pi)) {
+	raise_error("invalid format, document not terminated", pi->str, pi->s);
+    }
     if ('"' == *pi->s || ('\'' == *pi->s && StrictEffort != pi->options->effort)) {
         char	term = *pi->s;
         
         pi->s++;	// skip quote character
         value = pi->s;
-        for (; *pi->s != term; pi->s++) {
-            if ('\0' == *pi->s) {
-                raise_error("invalid format, document not terminated", pi->str, pi->s);
-            }
+        pi->s = ox_scan_char(pi->s, pi->end, term);
+        if (at_end(pi)) {
+            raise_error("invalid format, document not terminated", pi->str, pi->s);
         }
-        *pi->s = '\0'; // terminate value
+        *lenp = pi->s - value;
         pi->s++;	   // move past quote
     } else if (StrictEffort == pi->options->effort) {
 	raise_error("invalid format, expected a quote character", pi->str, pi->s);
     } else {
         value = pi->s;
         next_white(pi);
-	if ('\0' == *pi->s) {
+	if (at_end(pi)) {
 	    raise_error("invalid format, document not terminated", pi->str, pi->s);
         }
-        *pi->s++ = '\0'; // terminate value
+        *lenp = pi->s - value;
+        pi->s++;	   // move past white space
     }
     return value;
 }
 
+/* Entered after the '&' with *sp the position and end the end of the text.
+ * If the special character is not recognized the '&' is returned and *sp is
+ * left after the '&' so the rest is read as plain text. Text and attribute
+ * values both decode this way.
+ */
 static int
-read_coded_char(PInfo pi) {
+read_coded_char(const char **sp, const char *end) {
     char	*b, buf[8];
-    char	*end = buf + sizeof(buf);
-    char	*s;
+    char	*bend = buf + sizeof(buf);
+    const char	*s;
     int	c;
 
-    for (b = buf, s = pi->s; b < end; b++, s++) {
+    for (b = buf, s = *sp; b < bend && s < end; b++, s++) {
 	if (';' == *s) {
 	    *b = '\0';
 	    s++;
@@ -671,93 +602,60 @@ read_coded_char(PInfo pi) {
 	}
 	*b = *s;
     }
-    if (b > end) {
-	return *pi->s;
+    if (bend <= b || *sp == s || ';' != *(s - 1)) {
+	return '&';
     }
     if ('#' == *buf) {
-	c = (int)strtol(buf + 1, &end, 10);
-	if (0 >= c || '\0' != *end) {
-	    return *pi->s;
+	if ('x' == buf[1] || 'X' == buf[1]) {
+	    c = (int)strtol(buf + 2, &bend, 16);
+	} else {
+	    c = (int)strtol(buf + 1, &bend, 10);
+	}
+	if (0 >= c || '\0' != *bend) {
+	    return '&';
 	}
-	pi->s = s;
+	*sp = s;
 
 	return c;
     }
     if (0 == strcasecmp(buf, "nbsp")) {
-	pi->s = s;
+	*sp = s;
 	return ' ';
     } else if (0 == strcasecmp(buf, "lt")) {
-	pi->s = s;
+	*sp = s;
 	return '<';
     } else if (0 == strcasecmp(buf, "gt")) {
-	pi->s = s;
+	*sp = s;
 	return '>';
     } else if (0 == strcasecmp(buf, "amp")) {
-	pi->s = s;
+	*sp = s;
 	return '&';
     } else if (0 == strcasecmp(buf, "quot")) {
-	pi->s = s;
+	*sp = s;
 	return '"';
     } else if (0 == strcasecmp(buf, "apos")) {
-	pi->s = s;
+	*sp = s;
 	return '\'';
     }
-    return *pi->s;
+    return '&';
 }
 
-static int
-collapse_special(char *str) {
-    char	*s = str;
-    char	*b = str;
-
-    while ('\0' != *s) {
-	if ('&' == *s) {
-	    int		c;
-	    char	*end;
-	    
+/* Decodes the special characters in an attribute value and appends the
+ * result to the scratch buffer.
+ */
+static void
+collapse_special(PInfo pi, const char *s, const char *end) {
+    const char	*start;
+
+    while (s < end) {
+	start = s;
+	if (0 == (s = memchr(s, '&', end - s))) {
+	    s = end;
+	}
+	buf_append(pi, start, s - start);
+	if (s < end) {
 	    s++;
-	    if ('#' == *s) {
-		s++;
-		if ('x' == *s || 'X' == *s) {
-		    s++;
-		    c = (int)strtol(s, &end, 16);
-		} else {
-		    c = (int)strtol(s, &end, 10);
-		}
-		if (';' != *end) {
-		    return EDOM;
-		}
-		s = end + 1;
-	    } else if (0 == strncasecmp(s, "lt;", 3)) {
-		c = '<';
-		s += 3;
-	    } else if (0 == strncasecmp(s, "gt;", 3)) {
-		c = '>';
-		s += 3;
-	    } else if (0 == strncasecmp(s, "amp;", 4)) {
-		c = '&';
-		s += 4;
-	    } else if (0 == strncasecmp(s, "quot;", 5)) {
-		c = '"';
-		s += 5;
-	    } else if (0 == strncasecmp(s, "apos;", 5)) {
-		c = '\'';
-		s += 5;
-	    } else {
-		c = '?';
-		while (';' != *s++) {
-		    if ('\0' == *s) {
-			return EDOM;
-		    }
-		}
-		s++;
-	    }
-	    *b++ = (char)c;
-	} else {
-	    *b++ = *s++;
+	    buf_append_char(pi, (char)read_coded_char(&s, end));
 	}
     }
-    *b = '\0';
-
-    return 0;
 }
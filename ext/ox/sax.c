@@ -36,9 +36,35 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
+#if defined(HAVE_SYS_MMAN_H) && !defined(JRUBY_RUBY)
+#define SAX_MMAP	1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define SAX_MMAP	0
+#endif
 
 #include "ruby.h"
 #include "ox.h"
+#include "filter.h"
+#include "scan.h"
+#include "dtoa.h"
+#include "time_parse.h"
+
+typedef struct _SaxHas {
+    int         instruct;
+    int         attr;
+    int         attr_value;
+    int         doctype;
+    int         comment;
+    int         cdata;
+    int         text;
+    int         value;
+    int         start_element;
+    int         start_attrs;	// start_element() takes the attributes as a Hash
+    int         end_element;
+    int         skip;		// start_element() may call skip!()
+} *SaxHas;
 
 typedef struct _SaxDrive {
     char        base_buf[0x00010000];
@@ -48,37 +74,58 @@ typedef struct _SaxDrive {
     char        *cur;
     char        *read_end;      // one past last character read
     char        *str;           // start of current string being read
-    int         line;
-    int         col;
+    size_t	buf_size;	// usual size of buf, it grows for long tokens
+    double	buf_growth;	// factor buf grows by
+    size_t	buf_max;	// largest buf may grow to, 0 for no limit
+    size_t	str_len;	// length of str once the end has been found
+    int         line;		// line of the character before buf
+    int         col;		// column of the character before buf
     VALUE       handler;
     VALUE	value_obj;
+    int		collapsed;	// special characters in the current value converted
     int         (*read_func)(struct _SaxDrive *dr);
     int         convert_special;
+    VALUE	batch;		// events waiting for the handler, Qnil if not batching
+    long	batch_max;	// events per batch
+    long	batch_cnt;	// entries in batch, 3 per event
     union {
         int     	fd;
         VALUE   	io;
-	const char	*in_str;
     };
-    int         has_instruct;
-    int         has_attr;
-    int         has_attr_value;
-    int         has_doctype;
-    int         has_comment;
-    int         has_cdata;
-    int         has_text;
-    int         has_value;
-    int         has_start_element;
-    int         has_end_element;
+    VALUE	src;		// String parsed in place, Qnil when reading
+    int		in_place;	// buf holds the whole document and is read only
+#if SAX_MMAP
+    char	*map;		// mapped file, 0 if not mapped
+    size_t	map_size;
+#endif
+    char	*tbuf;		// terminated copies of strings when parsing in place
+    size_t	tbuf_size;
+    VALUE	rbuf;		// String reused for reads from io, Qnil if not used
+    struct _SaxHas	has;		// callbacks to make, none outside selected paths
+    struct _SaxHas	selected_has;	// callbacks to make inside selected paths
     int         has_error;
+    int		skip;		// skip!() was called from start_element()
+    VALUE	prev_drive;	// drive the handler was linked to before this one
+    Filter	filter;		// 0 if all events are wanted
+    FNode	*states;	// filter states for the current element
+    FNode	top_state;
+    int		state_cnt;
+    int		filtering;	// outside of a selected path
 #if HAS_ENCODING_SUPPORT
     rb_encoding *encoding;
 #endif
+    VALUE	self;		// the Ruby object that owns the drive
 } *SaxDrive;
 
-static void     sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, int convert);
+static void     sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, SaxOptions options);
 static void     sax_drive_cleanup(SaxDrive dr);
+static void     sax_drive_mark(void *ptr);
+static void     sax_drive_free(void *ptr);
 static int      sax_drive_read(SaxDrive dr);
+static void     sax_drive_resize(SaxDrive dr, size_t size);
 static void     sax_drive_error(SaxDrive dr, const char *msg, int critical);
+static void     sax_drive_position(SaxDrive dr, const char *end, int *linep, int *colp);
+static void     sax_drive_flush(SaxDrive dr);
 
 static int      read_children(SaxDrive dr, int first);
 static int      read_instruction(SaxDrive dr);
@@ -86,11 +133,15 @@ static int      read_doctype(SaxDrive dr);
 static int      read_cdata(SaxDrive dr);
 static int      read_comment(SaxDrive dr);
 static int      read_element(SaxDrive dr);
+static int      read_filtered_element(SaxDrive dr, char c);
+static int      read_element_rest(SaxDrive dr, char c);
+static int      skip_element(SaxDrive dr, char c);
 static int      read_text(SaxDrive dr);
-static int      read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml);
+static int      read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml, VALUE attrs);
 static char     read_name_token(SaxDrive dr);
 static int      read_quoted_value(SaxDrive dr);
 static int      collapse_special(char *str);
+static void     sax_value_mark(void *ptr);
 
 static VALUE	rescue_cb(VALUE rdr, VALUE err);
 static VALUE    io_cb(VALUE rdr);
@@ -99,25 +150,25 @@ static int      read_from_io(SaxDrive dr);
 #ifndef JRUBY_RUBY
 static int      read_from_fd(SaxDrive dr);
 #endif
+#if SAX_MMAP
+static int      map_fd(SaxDrive dr);
+#endif
 static int      read_from_io_partial(SaxDrive dr);
-static int      read_from_str(SaxDrive dr);
 
+static VALUE	sax_class;
 static VALUE	sax_value_class;
+static ID	ox_drive_id;
 
-// This is only for CentOS 5.4 with Ruby 1.9.3-p0 and for OS X 10.6.
-#ifdef NEEDS_STPCPY
-char *stpncpy(char *dest, const char *src, size_t n) {
-    size_t	cnt = strlen(src) + 1;
-    
-    if (n < cnt) {
-	cnt = n;
-    }
-    strncpy(dest, src, cnt);
-
-    return dest + cnt - 1;
-}
+#ifdef HAVE_TYPE_RB_DATA_TYPE_T
+static const rb_data_type_t	sax_drive_type = {
+    "Ox/Sax/Drive",
+    { sax_drive_mark, sax_drive_free, 0, },
+};
 #endif
 
+/* The position in the document is not tracked as characters are read. It is
+ * worked out from the buffer when it is needed, see sax_drive_position().
+ */
 static inline char
 sax_drive_get(SaxDrive dr) {
     if (dr->read_end <= dr->cur) {
@@ -125,33 +176,47 @@ sax_drive_get(SaxDrive dr) {
             return 0;
         }
     }
-    if ('\n' == *dr->cur) {
-        dr->line++;
-        dr->col = 0;
-    }
-    dr->col++;
-    
     return *dr->cur++;
 }
 
+/* Makes sure there is at least one character to look at. Returns 0 if there
+ * is or non-zero at the end of the input.
+ */
+static inline int
+sax_drive_fill(SaxDrive dr) {
+    if (dr->cur < dr->read_end) {
+        return 0;
+    }
+    if (0 != sax_drive_read(dr) || dr->read_end <= dr->cur) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Moves cur up to the next term character without consuming it. Returns
+ * term or '\0' if the input ends first.
+ */
+inline static char
+scan_to_char(SaxDrive dr, char term) {
+    while (0 == sax_drive_fill(dr)) {
+        dr->cur = (char*)ox_scan_char(dr->cur, dr->read_end, term);
+        if (dr->cur < dr->read_end) {
+            return term;
+        }
+    }
+    return '\0';
+}
+
 /* Starts by reading a character so it is safe to use with an empty or
  * compacted buffer.
  */
 inline static char
 next_non_white(SaxDrive dr) {
-    char        c;
-
-    while ('\0' != (c = sax_drive_get(dr))) {
-	switch(c) {
-	case ' ':
-	case '\t':
-	case '\f':
-	case '\n':
-	case '\r':
-	    break;
-	default:
-	    return c;
-	}
+    while (0 == sax_drive_fill(dr)) {
+        dr->cur = (char*)ox_skip_white(dr->cur, dr->read_end);
+        if (dr->cur < dr->read_end) {
+            return *dr->cur++;
+        }
     }
     return '\0';
 }
@@ -194,23 +259,92 @@ is_white(char c) {
     return 0;
 }
 
+/* Marks the end of the current string. Strings in the read buffer are
+ * terminated in place. A String parsed in place is never written to so only
+ * the length is kept.
+ */
+inline static void
+sax_term(SaxDrive dr, char *end) {
+    dr->str_len = end - dr->str;
+    if (!dr->in_place) {
+        *end = '\0';
+    }
+}
+
+/* Returns the current string with a '\0' after it. When parsing in place the
+ * string is copied into tbuf first and dr->str is moved to the copy.
+ */
+static char*
+sax_cstr(SaxDrive dr) {
+    if (!dr->in_place || dr->tbuf == dr->str) {
+        return dr->str;
+    }
+    if (dr->tbuf_size <= dr->str_len) {
+        size_t  size = dr->str_len * 2 + 1;
+
+        if (dr->tbuf == dr->base_buf) {
+            dr->tbuf = ALLOC_N(char, size);
+        } else {
+            REALLOC_N(dr->tbuf, char, size);
+        }
+        dr->tbuf_size = size;
+    }
+    memcpy(dr->tbuf, dr->str, dr->str_len);
+    dr->tbuf[dr->str_len] = '\0';
+    dr->str = dr->tbuf;
+
+    return dr->str;
+}
+
+/* Replaces the special character sequences such as &lt; in the current
+ * string. Nothing is copied if there are none.
+ */
+static void
+sax_collapse(SaxDrive dr) {
+    char        *str;
+
+    if (0 == memchr(dr->str, '&', dr->str_len)) {
+        return;
+    }
+    str = sax_cstr(dr);
+    if (0 != collapse_special(str) && 0 != strchr(str, '&')) {
+        sax_drive_error(dr, "invalid format, special character does not end with a semicolon", 0);
+    }
+    dr->str_len = strlen(str);
+}
+
+inline static VALUE
+sax_str_new(SaxDrive dr) {
+    VALUE       rs = rb_str_new(dr->str, dr->str_len);
+
+#if HAS_ENCODING_SUPPORT
+    if (0 != dr->encoding) {
+        rb_enc_associate(rs, dr->encoding);
+    }
+#endif
+    return rs;
+}
+
+/* Returns the Symbol for the len bytes at str. The name does not have to be
+ * terminated so tokens parsed in place are looked up without a copy.
+ */
 inline static VALUE
-str2sym(const char *str, SaxDrive dr) {
+str2sym(const char *str, size_t len, SaxDrive dr) {
     VALUE       *slot;
     VALUE       sym;
 
-    if (Qundef == (sym = ox_cache_get(ox_symbol_cache, str, &slot))) {
+    if (Qundef == (sym = ox_cache_getn(ox_symbol_cache, str, len, ox_cache_hash(str, len), &slot))) {
 #if HAS_ENCODING_SUPPORT
         if (0 != dr->encoding) {
-	    VALUE	rstr = rb_str_new2(str);
+	    VALUE	rstr = rb_str_new(str, len);
 
             rb_enc_associate(rstr, dr->encoding);
 	    sym = rb_funcall(rstr, ox_to_sym_id, 0);
         } else {
-	    sym = ID2SYM(rb_intern(str));
+	    sym = ID2SYM(rb_intern2(str, len));
 	}
 #else
-        sym = ID2SYM(rb_intern(str));
+        sym = ID2SYM(rb_intern2(str, len));
 #endif
         *slot = sym;
     }
@@ -218,27 +352,90 @@ str2sym(const char *str, SaxDrive dr) {
 }
 
 
+/* Makes a handler callback or, when batching, adds the event to the batch as
+ * a method and two arguments and hands the batch over once it is full.
+ */
+static void
+sax_call(SaxDrive dr, ID method, int argc, VALUE *argv) {
+    if (Qnil == dr->batch) {
+        rb_funcall2(dr->handler, method, argc, argv);
+        return;
+    }
+    // The Array is filled once and then overwritten so it never has to grow
+    // or shrink between batches.
+    rb_ary_store(dr->batch, dr->batch_cnt++, ID2SYM(method));
+    rb_ary_store(dr->batch, dr->batch_cnt++, argv[0]);
+    rb_ary_store(dr->batch, dr->batch_cnt++, (1 < argc) ? argv[1] : Qnil);
+    if (dr->batch_max * 3 <= dr->batch_cnt) {
+        sax_drive_flush(dr);
+    }
+}
+
+static VALUE
+parse_cb(VALUE rdr) {
+    SaxDrive    dr = (SaxDrive)rdr;
+
+    read_children(dr, 1);
+    sax_drive_flush(dr);
+
+    return Qnil;
+}
+
+/* The buffers and any mapped file are released even if a callback raises.
+ */
+static VALUE
+cleanup_cb(VALUE rdr) {
+    SaxDrive	dr = (SaxDrive)rdr;
+
+    if (Qundef != dr->prev_drive) {
+	rb_ivar_set(dr->handler, ox_drive_id, dr->prev_drive);
+    }
+    sax_drive_cleanup(dr);
+
+    return Qnil;
+}
+
+/* The drive is kept in a Ruby object instead of on the stack so that the GC
+ * finds the objects it refers to through sax_drive_mark() and frees it even
+ * if the parse never finishes, as when the Fiber of a Pusher is dropped
+ * before the end of the document.
+ */
 void
-ox_sax_parse(VALUE handler, VALUE io, int convert) {
-    struct _SaxDrive    dr;
-    
-    sax_drive_init(&dr, handler, io, convert);
+ox_sax_parse(VALUE handler, VALUE io, SaxOptions options) {
+    SaxDrive	dr;
+    VALUE	drive;
+
+#ifdef HAVE_TYPE_RB_DATA_TYPE_T
+    drive = TypedData_Make_Struct(0, struct _SaxDrive, &sax_drive_type, dr);
+#else
+    drive = Data_Make_Struct(0, struct _SaxDrive, sax_drive_mark, sax_drive_free, dr);
+#endif
+    dr->self = drive;
+    sax_drive_init(dr, handler, io, options);
+    // skip!() finds the drive through the handler, the previous link is put
+    // back when done in case the handler is already in use by another parse
+    dr->skip = 0;
+    dr->prev_drive = Qundef;
+    if (dr->has.skip && !OBJ_FROZEN(handler)) {
+	dr->prev_drive = rb_attr_get(handler, ox_drive_id);
+	rb_ivar_set(handler, ox_drive_id, drive);
+    }
 #if 0
     printf("*** sax_parse with these flags\n");
-    printf("    has_instruct = %s\n", dr.has_instruct ? "true" : "false");
-    printf("    has_attr = %s\n", dr.has_attr ? "true" : "false");
-    printf("    has_attr_value = %s\n", dr.has_attr_value ? "true" : "false");
-    printf("    has_doctype = %s\n", dr.has_doctype ? "true" : "false");
-    printf("    has_comment = %s\n", dr.has_comment ? "true" : "false");
-    printf("    has_cdata = %s\n", dr.has_cdata ? "true" : "false");
-    printf("    has_text = %s\n", dr.has_text ? "true" : "false");
-    printf("    has_value = %s\n", dr.has_value ? "true" : "false");
-    printf("    has_start_element = %s\n", dr.has_start_element ? "true" : "false");
-    printf("    has_end_element = %s\n", dr.has_end_element ? "true" : "false");
-    printf("    has_error = %s\n", dr.has_error ? "true" : "false");
+    printf("    has_instruct = %s\n", dr->has.instruct ? "true" : "false");
+    printf("    has_attr = %s\n", dr->has.attr ? "true" : "false");
+    printf("    has_attr_value = %s\n", dr->has.attr_value ? "true" : "false");
+    printf("    has_doctype = %s\n", dr->has.doctype ? "true" : "false");
+    printf("    has_comment = %s\n", dr->has.comment ? "true" : "false");
+    printf("    has_cdata = %s\n", dr->has.cdata ? "true" : "false");
+    printf("    has_text = %s\n", dr->has.text ? "true" : "false");
+    printf("    has_value = %s\n", dr->has.value ? "true" : "false");
+    printf("    has_start_element = %s\n", dr->has.start_element ? "true" : "false");
+    printf("    has_end_element = %s\n", dr->has.end_element ? "true" : "false");
+    printf("    has_error = %s\n", dr->has_error ? "true" : "false");
 #endif
-    read_children(&dr, 1);
-    sax_drive_cleanup(&dr);
+    rb_ensure(parse_cb, (VALUE)dr, cleanup_cb, (VALUE)dr);
+    RB_GC_GUARD(drive); // not a tail call so drive stays on the stack
 }
 
 inline static int
@@ -257,13 +454,38 @@ respond_to(VALUE obj, ID method) {
 #endif
 }
 
+static int
+method_arity(VALUE obj, ID method) {
+    VALUE	m = rb_funcall(obj, rb_intern("method"), 1, ID2SYM(method));
+
+    return NUM2INT(rb_funcall(m, rb_intern("arity"), 0));
+}
+
+/* Returns the number of arguments the method takes. Methods with a variable
+ * number of arguments count as taking the most they require plus one.
+ */
+static int
+method_argc(VALUE obj, ID method) {
+    int		arity = method_arity(obj, method);
+
+    return (arity < 0) ? -arity : arity;
+}
+
 static void
-sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, int convert) {
-    if (ox_stringio_class == rb_obj_class(io)) {
+sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, SaxOptions options) {
+    if (0 < options->batch && !respond_to(handler, ox_events_id)) {
+        rb_raise(rb_eArgError, "sax_parse handler must respond to events() when batching.\n");
+    }
+    dr->rbuf = Qnil;
+    dr->src = Qnil;
+    dr->read_func = 0;
+    if (T_STRING == rb_type(io)) {
+        // a frozen copy shares the memory and can not be changed by a callback
+        dr->src = rb_str_new_frozen(io);
+    } else if (ox_stringio_class == rb_obj_class(io)) {
 	VALUE	s = rb_funcall2(io, ox_string_id, 0, 0);
 
-	dr->read_func = read_from_str;
-	dr->in_str = StringValuePtr(s);
+        dr->src = rb_str_new_frozen(StringValue(s));
     } else if (rb_respond_to(io, ox_readpartial_id)) {
 #ifdef JRUBY_RUBY
 	dr->read_func = read_from_io_partial;
@@ -297,29 +519,56 @@ sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, int convert) {
     } else {
         rb_raise(rb_eArgError, "sax_parser io argument must respond to readpartial() or read().\n");
     }
-    dr->buf = dr->base_buf;
-    *dr->buf = '\0';
-    dr->buf_end = dr->buf + sizeof(dr->base_buf) - 1; // 1 less to make debugging easier
-    dr->cur = dr->buf;
-    dr->read_end = dr->buf;
-    dr->str = 0;
-    dr->line = 1;
-    dr->col = 0;
-    dr->handler = handler;
-    dr->value_obj = rb_data_object_alloc(sax_value_class, dr, 0, 0);
-    rb_gc_register_address(&dr->value_obj);
-    dr->convert_special = convert;
-    dr->has_instruct = respond_to(handler, ox_instruct_id);
-    dr->has_attr = respond_to(handler, ox_attr_id);
-    dr->has_attr_value = respond_to(handler, ox_attr_value_id);
-    dr->has_doctype = respond_to(handler, ox_doctype_id);
-    dr->has_comment = respond_to(handler, ox_comment_id);
-    dr->has_cdata = respond_to(handler, ox_cdata_id);
-    dr->has_text = respond_to(handler, ox_text_id);
-    dr->has_value = respond_to(handler, ox_value_id);
-    dr->has_start_element = respond_to(handler, ox_start_element_id);
-    dr->has_end_element = respond_to(handler, ox_end_element_id);
+    if (read_from_io_partial == dr->read_func || read_from_io == dr->read_func) {
+        // Only pass a buffer if the method might take one. Methods written
+        // in C that take optional arguments have an arity of -1.
+        if (1 != method_arity(io, (read_from_io == dr->read_func) ? ox_read_id : ox_readpartial_id)) {
+            dr->rbuf = rb_str_new(0, 0);
+        }
+    }
+    dr->value_obj = Data_Wrap_Struct(sax_value_class, sax_value_mark, 0, dr);
+    dr->collapsed = 0;
+    dr->convert_special = options->convert_special;
+    dr->has.instruct = respond_to(handler, ox_instruct_id);
+    dr->has.attr = respond_to(handler, ox_attr_id);
+    dr->has.attr_value = respond_to(handler, ox_attr_value_id);
+    dr->has.doctype = respond_to(handler, ox_doctype_id);
+    dr->has.comment = respond_to(handler, ox_comment_id);
+    dr->has.cdata = respond_to(handler, ox_cdata_id);
+    dr->has.text = respond_to(handler, ox_text_id);
+    dr->has.value = respond_to(handler, ox_value_id);
+    dr->has.start_element = respond_to(handler, ox_start_element_id);
+    dr->has.start_attrs = dr->has.start_element && 2 <= method_argc(handler, ox_start_element_id);
+    dr->has.end_element = respond_to(handler, ox_end_element_id);
+    dr->has.skip = dr->has.start_element && Qtrue == rb_obj_is_kind_of(handler, sax_class);
     dr->has_error = respond_to(handler, ox_error_id);
+    if (0 < options->batch) {
+        // values are only valid during the callback so they can not be batched
+        dr->has.text = dr->has.text || dr->has.value;
+        dr->has.attr = dr->has.attr || dr->has.attr_value;
+        dr->has.value = 0;
+        dr->has.attr_value = 0;
+        // start_element() is called after the element has been read
+        dr->has.skip = 0;
+        dr->batch_max = options->batch;
+        dr->batch = rb_ary_new2(options->batch * 3);
+    } else {
+        dr->batch_max = 0;
+        dr->batch = Qnil;
+    }
+    dr->batch_cnt = 0;
+    dr->selected_has = dr->has;
+    dr->filter = options->filter;
+    if (0 == dr->filter) {
+        dr->filtering = 0;
+    } else {
+        // nothing is wanted until a selected path is reached
+        memset(&dr->has, 0, sizeof(dr->has));
+        dr->top_state = &dr->filter->root;
+        dr->states = &dr->top_state;
+        dr->state_cnt = 1;
+        dr->filtering = 1;
+    }
 #if HAS_ENCODING_SUPPORT
     if ('\0' == *ox_default_options.encoding) {
         dr->encoding = 0;
@@ -327,45 +576,120 @@ sax_drive_init(SaxDrive dr, VALUE handler, VALUE io, int convert) {
         dr->encoding = rb_enc_find(ox_default_options.encoding);
     }
 #endif
+    // Everything that can raise is done above so the file is not mapped
+    // until nothing else can fail.
+#if SAX_MMAP
+    dr->map = 0;
+#endif
+    dr->in_place = 1;
+    if (Qnil != dr->src) {
+        dr->buf = RSTRING_PTR(dr->src);
+        dr->buf_end = dr->buf + RSTRING_LEN(dr->src);
+#if SAX_MMAP
+    } else if (read_from_fd == dr->read_func && 0 == map_fd(dr)) {
+        // buf is set to the mapping
+#endif
+    } else {
+        dr->in_place = 0;
+        dr->buf_size = (0 < options->buffer_size) ? (size_t)options->buffer_size : sizeof(dr->base_buf) - 1;
+        dr->buf_growth = options->buffer_growth;
+        dr->buf_max = (size_t)options->max_buffer_size;
+        if (0 < dr->buf_max && dr->buf_max < dr->buf_size) {
+            dr->buf_size = dr->buf_max;
+        }
+        dr->buf = dr->base_buf;
+        dr->buf_end = dr->buf;
+        dr->read_end = dr->buf;
+        dr->cur = dr->buf;
+        dr->str = 0;
+        sax_drive_resize(dr, dr->buf_size);
+        *dr->buf = '\0';
+        dr->tbuf = 0;
+        dr->tbuf_size = 0;
+    }
+    if (dr->in_place) {
+        // The whole document is already in memory so it is scanned where it
+        // is. Strings are copied into the base buffer only when a terminated
+        // string is needed.
+        dr->read_end = dr->buf_end;
+        dr->tbuf = dr->base_buf;
+        dr->tbuf_size = sizeof(dr->base_buf);
+    }
+    dr->cur = dr->buf;
+    dr->str = 0;
+    dr->str_len = 0;
+    dr->line = 1;
+    dr->col = 0;
+    dr->handler = handler;
 }
 
+/* Releases the buffers and any mapped file. It is called when the parse ends
+ * and again when the drive is freed so it leaves the drive with nothing to
+ * release. A Value kept past the end of the parse is then empty.
+ */
 static void
 sax_drive_cleanup(SaxDrive dr) {
-    rb_gc_unregister_address(&dr->value_obj);
-    if (dr->base_buf != dr->buf) {
-        xfree(dr->buf);
+    if (!dr->in_place) {
+        if (0 != dr->buf && dr->base_buf != dr->buf) {
+            xfree(dr->buf);
+        }
+    } else if (0 != dr->tbuf && dr->base_buf != dr->tbuf) {
+        xfree(dr->tbuf);
+    }
+#if SAX_MMAP
+    if (0 != dr->map) {
+        munmap(dr->map, dr->map_size);
+        dr->map = 0;
     }
+#endif
+    dr->buf = 0;
+    dr->tbuf = 0;
+    dr->str = 0;
+    dr->str_len = 0;
+}
+
+static void
+sax_drive_mark(void *ptr) {
+    SaxDrive    dr = (SaxDrive)ptr;
+
+    rb_gc_mark(dr->handler);
+    rb_gc_mark(dr->value_obj);
+    rb_gc_mark(dr->batch);
+    rb_gc_mark(dr->src);
+    rb_gc_mark(dr->rbuf);
+    rb_gc_mark(dr->prev_drive);
+    if (read_from_io_partial == dr->read_func || read_from_io == dr->read_func) {
+        rb_gc_mark(dr->io);
+    }
+}
+
+static void
+sax_drive_free(void *ptr) {
+    sax_drive_cleanup((SaxDrive)ptr);
+    xfree(ptr);
 }
 
 static int
 sax_drive_read(SaxDrive dr) {
     int         err;
+    size_t      size = dr->buf_end - dr->buf;
     size_t      shift = 0;
-    
-    if (dr->buf < dr->cur) {
+
+    if (dr->in_place) { // nothing more to read
+        return -1;
+    }
+    // Reads may return less than asked for, a few bytes at a time from a pipe
+    // or socket, so only make room once less than half the buffer is free.
+    if (dr->buf < dr->cur && (size_t)(dr->buf_end - dr->cur) < size / 2) {
         if (0 == dr->str) {
             shift = dr->cur - dr->buf;
         } else {
             shift = dr->str - dr->buf;
         }
         //printf("\n*** shift: %lu\n", shift);
-        if (0 == shift) { // no space left so allocate more
-            char        *old = dr->buf;
-            size_t      size = dr->buf_end - dr->buf;
-        
-            if (dr->buf == dr->base_buf) {
-                dr->buf = ALLOC_N(char, size * 2);
-                memcpy(dr->buf, old, size);
-            } else {
-		REALLOC_N(dr->buf, char, size * 2);
-            }
-            dr->buf_end = dr->buf + size * 2;
-            dr->cur = dr->buf + (dr->cur - old);
-            dr->read_end = dr->buf + (dr->read_end - old);
-            if (0 != dr->str) {
-                dr->str = dr->buf + (dr->str - old);
-            }
-        } else {
+        if (0 < shift) {
+            // keep the position of the characters about to be dropped
+            sax_drive_position(dr, dr->buf + shift, &dr->line, &dr->col);
             memmove(dr->buf, dr->buf + shift, dr->read_end - (dr->buf + shift));
             dr->cur -= shift;
             dr->read_end -= shift;
@@ -373,6 +697,27 @@ sax_drive_read(SaxDrive dr) {
                 dr->str -= shift;
             }
         }
+        if (dr->buf_size < size && (size_t)(dr->read_end - dr->buf) < dr->buf_size / 2) {
+            // an oversized token has been passed so go back to the usual size
+            sax_drive_resize(dr, dr->buf_size);
+        } else if ((size_t)(dr->buf_end - dr->cur) < size / 2) { // still not enough space so allocate more
+            size_t      grown = (size_t)(size * dr->buf_growth);
+
+            if (0 < dr->buf_max && dr->buf_max < grown) {
+                grown = dr->buf_max;
+            }
+            if (size < grown) {
+                sax_drive_resize(dr, grown);
+            } else if (dr->buf_end <= dr->cur) {
+                int     line;
+                int     col;
+
+                sax_drive_position(dr, dr->cur, &line, &col);
+                sax_drive_flush(dr);
+                rb_raise(rb_eIOError, "token larger than the %lu byte maximum buffer size at line %d, column %d\n",
+                         (unsigned long)dr->buf_max, line, col);
+            }
+        }
     }
     err = dr->read_func(dr);
     *dr->read_end = '\0';
@@ -380,18 +725,93 @@ sax_drive_read(SaxDrive dr) {
     return err;
 }
 
+/* Moves what has been read into a buffer that holds size characters. The
+ * base buffer is used if it is large enough.
+ */
+static void
+sax_drive_resize(SaxDrive dr, size_t size) {
+    char        *old = dr->buf;
+
+    // one extra for the '\0' written after the last character read
+    if (size < sizeof(dr->base_buf)) {
+        if (dr->base_buf != old) {
+            memcpy(dr->base_buf, old, dr->read_end - old);
+            xfree(old);
+            dr->buf = dr->base_buf;
+        }
+    } else if (dr->base_buf == old) {
+        dr->buf = ALLOC_N(char, size + 1);
+        memcpy(dr->buf, old, dr->read_end - old);
+    } else {
+        REALLOC_N(dr->buf, char, size + 1);
+    }
+    dr->buf_end = dr->buf + size;
+    dr->cur = dr->buf + (dr->cur - old);
+    dr->read_end = dr->buf + (dr->read_end - old);
+    if (0 != dr->str) {
+        dr->str = dr->buf + (dr->str - old);
+    }
+}
+
+/* Hands any batched events to the handler.
+ */
+static void
+sax_drive_flush(SaxDrive dr) {
+    if (0 < dr->batch_cnt) {
+        VALUE   args[1];
+
+        if (dr->batch_cnt < RARRAY_LEN(dr->batch)) {
+            // drop what is left from the last full batch
+            rb_ary_resize(dr->batch, dr->batch_cnt);
+        }
+        *args = dr->batch;
+        dr->batch_cnt = 0;
+        rb_funcall2(dr->handler, ox_events_id, 1, args);
+    }
+}
+
+/* Works out the line and column of the character before end from the
+ * position of the start of the buffer and the newlines after it. The column
+ * is the number of characters read on the line, the same on every line, so
+ * it is 0 right after a newline.
+ */
+static void
+sax_drive_position(SaxDrive dr, const char *end, int *linep, int *colp) {
+    const char  *s;
+
+    if (dr->read_end < end) { // one past the end after reading the end of input
+        end = dr->read_end;
+    }
+    for (s = end; dr->buf < s && '\n' != *(s - 1); s--) {
+    }
+    if (dr->buf == s) { // no newline since the start of the buffer
+        *linep = dr->line;
+        *colp = dr->col + (int)(end - dr->buf);
+    } else {
+        *linep = dr->line + (int)ox_count_char(dr->buf, s, '\n');
+        *colp = (int)(end - s);
+    }
+}
+
 static void
 sax_drive_error(SaxDrive dr, const char *msg, int critical) {
+    int         line;
+    int         col;
+
+    sax_drive_position(dr, dr->cur, &line, &col);
+    if (dr->has_error || critical) {
+        // keep the events in order
+        sax_drive_flush(dr);
+    }
     if (dr->has_error) {
         VALUE   args[3];
 
         args[0] = rb_str_new2(msg);
-        args[1] = INT2FIX(dr->line);
-        args[2] = INT2FIX(dr->col);
+        args[1] = INT2FIX(line);
+        args[2] = INT2FIX(col);
         rb_funcall2(dr->handler, ox_error_id, 3, args);
     } else if (critical) {
-        sax_drive_cleanup(dr);
-        rb_raise(rb_eSyntaxError, "%s at line %d, column %d\n", msg, dr->line, dr->col);
+        rb_raise(rb_eSyntaxError, "%s at line %d, column %d\n", msg, line, col);
     }
 }
 
@@ -450,7 +870,10 @@ read_children(SaxDrive dr, int first) {
                 for (i = 7; 0 < i; i--) {
                     sax_drive_get(dr);
                 }
-                if (0 == strncmp("DOCTYPE", dr->str, 7)) {
+                if (dr->read_end < dr->str + 7) {
+                    sax_drive_error(dr, "invalid format, DOCTYPE or comment not terminated", 1);
+                    err = 1;
+                } else if (0 == strncmp("DOCTYPE", dr->str, 7)) {
                     if (element_read || !first) {
                         sax_drive_error(dr, "invalid format, DOCTYPE can not come after an element", 0);
                     }
@@ -493,13 +916,13 @@ read_instruction(SaxDrive dr) {
     if ('\0' == (c = read_name_token(dr))) {
         return -1;
     }
-    if (dr->has_instruct) {
+    if (dr->has.instruct) {
         VALUE       args[1];
 
-        args[0] = rb_str_new2(dr->str);
-        rb_funcall2(dr->handler, ox_instruct_id, 1, args);
+        args[0] = rb_str_new(dr->str, dr->str_len);
+        sax_call(dr, ox_instruct_id, 1, args);
     }
-    if (0 != read_attrs(dr, c, '?', '?', (0 == strcmp("xml", dr->str)))) {
+    if (0 != read_attrs(dr, c, '?', '?', (3 == dr->str_len && 0 == strncmp("xml", dr->str, 3)), Qnil)) {
         return -1;
     }
     c = next_non_white(dr);
@@ -516,21 +939,18 @@ read_instruction(SaxDrive dr) {
  */
 static int
 read_doctype(SaxDrive dr) {
-    char        c;
-
     dr->str = dr->cur - 1; // mark the start
-    while ('>' != (c = sax_drive_get(dr))) {
-        if ('\0' == c) {
-            sax_drive_error(dr, "invalid format, doctype terminated unexpectedly", 1);
-            return -1;
-        }
+    if ('\0' == scan_to_char(dr, '>')) {
+        sax_drive_error(dr, "invalid format, doctype terminated unexpectedly", 1);
+        return -1;
     }
-    *(dr->cur - 1) = '\0';
-    if (dr->has_doctype) {
+    sax_term(dr, dr->cur);
+    dr->cur++;
+    if (dr->has.doctype) {
         VALUE       args[1];
 
-        args[0] = rb_str_new2(dr->str);
-        rb_funcall2(dr->handler, ox_doctype_id, 1, args);
+        args[0] = rb_str_new(dr->str, dr->str_len);
+        sax_call(dr, ox_doctype_id, 1, args);
     }
     dr->str = 0;
 
@@ -541,38 +961,26 @@ read_doctype(SaxDrive dr) {
  */
 static int
 read_cdata(SaxDrive dr) {
-    char        c;
-    int         end = 0;
-
     dr->cur--; // back up to the start in case the cdata is empty
     dr->str = dr->cur; // mark the start
     while (1) {
-        c = sax_drive_get(dr);
-        if (']' == c) {
-            end++;
-        } else if ('>' == c) {
-            if (2 <= end) {
-                *(dr->cur - 3) = '\0';
-                break;
-            }
-            end = 0;
-        } else if ('\0' == c) {
+        if ('\0' == scan_to_char(dr, '>')) {
             sax_drive_error(dr, "invalid format, cdata terminated unexpectedly", 1);
             return -1;
-        } else {
-            end = 0;
         }
+        // everything from str on is kept in the buffer so look back for ]]
+        if (dr->str + 2 <= dr->cur && ']' == *(dr->cur - 1) && ']' == *(dr->cur - 2)) {
+            sax_term(dr, dr->cur - 2);
+            dr->cur++;
+            break;
+        }
+        dr->cur++;
     }
-    if (dr->has_cdata) {
+    if (dr->has.cdata) {
         VALUE       args[1];
 
-        args[0] = rb_str_new2(dr->str);
-#if HAS_ENCODING_SUPPORT
-        if (0 != dr->encoding) {
-            rb_enc_associate(args[0], dr->encoding);
-        }
-#endif
-        rb_funcall2(dr->handler, ox_cdata_id, 1, args);
+        args[0] = sax_str_new(dr);
+        sax_call(dr, ox_cdata_id, 1, args);
     }
     dr->str = 0;
 
@@ -584,39 +992,32 @@ read_cdata(SaxDrive dr) {
 static int
 read_comment(SaxDrive dr) {
     char        c;
-    int         end = 0;
 
     dr->str = dr->cur - 1; // mark the start
     while (1) {
+        if ('\0' == scan_to_char(dr, '-')) {
+            sax_drive_error(dr, "invalid format, comment terminated unexpectedly", 1);
+            return -1;
+        }
+        dr->cur++;
         c = sax_drive_get(dr);
         if ('-' == c) {
-            if (end) {
-                *(dr->cur - 2) = '\0';
-                break;
-            } else {
-                end = 1;
-            }
+            sax_term(dr, dr->cur - 2);
+            break;
         } else if ('\0' == c) {
             sax_drive_error(dr, "invalid format, comment terminated unexpectedly", 1);
             return -1;
-        } else {
-            end = 0;
         }
     }
     c = sax_drive_get(dr);
     if ('>' != c) {
         sax_drive_error(dr, "invalid format, comment terminated unexpectedly", 1);
     }
-    if (dr->has_comment) {
+    if (dr->has.comment) {
         VALUE       args[1];
 
-        args[0] = rb_str_new2(dr->str);
-#if HAS_ENCODING_SUPPORT
-        if (0 != dr->encoding) {
-            rb_enc_associate(args[0], dr->encoding);
-        }
-#endif
-        rb_funcall2(dr->handler, ox_comment_id, 1, args);
+        args[0] = sax_str_new(dr);
+        sax_call(dr, ox_comment_id, 1, args);
     }
     dr->str = 0;
 
@@ -628,29 +1029,122 @@ read_comment(SaxDrive dr) {
  */
 static int
 read_element(SaxDrive dr) {
-    VALUE       name = Qnil;
     char        c;
-    int         closed;
 
     if ('\0' == (c = read_name_token(dr))) {
         return -1;
     }
-    name = str2sym(dr->str, dr);
-    if (dr->has_start_element) {
+    if (dr->filtering) {
+        return read_filtered_element(dr, c);
+    }
+    return read_element_rest(dr, c);
+}
+
+/* Entered after the element name when outside of a selected path. Elements
+ * on the way to a selected path are read with the callbacks turned off and
+ * everything else is skipped.
+ */
+static int
+read_filtered_element(SaxDrive dr, char c) {
+    FNode       next[OX_FILTER_MAX];
+    FNode       *states = dr->states;
+    int         cnt = dr->state_cnt;
+    int         err;
+
+    switch (ox_filter_step(states, cnt, sax_cstr(dr), next, &dr->state_cnt)) {
+    case OX_FILTER_MATCH:
+        dr->filtering = 0;
+        dr->has = dr->selected_has;
+        err = read_element_rest(dr, c);
+        dr->filtering = 1;
+        memset(&dr->has, 0, sizeof(dr->has));
+        break;
+    case OX_FILTER_PATH:
+        dr->states = next;
+        err = read_element_rest(dr, c);
+        break;
+    case OX_FILTER_NONE:
+    default:
+        err = skip_element(dr, c);
+        break;
+    }
+    dr->states = states;
+    dr->state_cnt = cnt;
+
+    return err;
+}
+
+/* Skips what is left of an element after start_element() asked for it and
+ * then reports the end of the element. The c argument is as for
+ * skip_element().
+ */
+static int
+skip_rest(SaxDrive dr, VALUE name, char c) {
+    if (0 != skip_element(dr, c)) {
+        return -1;
+    }
+    if (dr->has.end_element) {
         VALUE       args[1];
 
         args[0] = name;
-        rb_funcall2(dr->handler, ox_start_element_id, 1, args);
+        sax_call(dr, ox_end_element_id, 1, args);
     }
-    if ('/' == c) {
-        closed = 1;
-    } else if ('>' == c) {
-        closed = 0;
+    dr->str = 0;
+
+    return 0;
+}
+
+/* Entered after the element name with c the character that ended the
+ * name. Returns status code.
+ */
+static int
+read_element_rest(SaxDrive dr, char c) {
+    VALUE       name = Qnil;
+    int         closed;
+
+    name = str2sym(dr->str, dr->str_len, dr);
+    if (dr->has.start_attrs) {
+        VALUE       args[2];
+
+        // the attributes come with the element so read them first
+        args[0] = name;
+        args[1] = rb_hash_new();
+        if ('/' == c) {
+            closed = 1;
+        } else if ('>' == c) {
+            closed = 0;
+        } else {
+            if (0 != read_attrs(dr, c, '/', '>', 0, args[1])) {
+                return -1;
+            }
+            closed = ('/' == *(dr->cur - 1));
+        }
+        dr->skip = 0;
+        sax_call(dr, ox_start_element_id, 2, args);
+        if (dr->skip) {
+            return skip_rest(dr, name, closed ? '/' : '>');
+        }
     } else {
-        if (0 != read_attrs(dr, c, '/', '>', 0)) {
-            return -1;
+        if (dr->has.start_element) {
+            VALUE       args[1];
+
+            args[0] = name;
+            dr->skip = 0;
+            sax_call(dr, ox_start_element_id, 1, args);
+            if (dr->skip) {
+                return skip_rest(dr, name, c);
+            }
+        }
+        if ('/' == c) {
+            closed = 1;
+        } else if ('>' == c) {
+            closed = 0;
+        } else {
+            if (0 != read_attrs(dr, c, '/', '>', 0, Qnil)) {
+                return -1;
+            }
+            closed = ('/' == *(dr->cur - 1));
         }
-        closed = ('/' == *(dr->cur - 1));
     }
     if (closed) {
         c = next_non_white(dr);
@@ -660,25 +1154,28 @@ read_element(SaxDrive dr) {
         }
     }
     if (closed) {
-        if (dr->has_end_element) {
+        if (dr->has.end_element) {
             VALUE       args[1];
 
             args[0] = name;
-            rb_funcall2(dr->handler, ox_end_element_id, 1, args);
+            sax_call(dr, ox_end_element_id, 1, args);
         }
     } else {
+        const char  *ename;
+
         if (0 != read_children(dr, 0)) {
             return -1;
         }
-        if (0 != strcmp(dr->str, rb_id2name(SYM2ID(name)))) {
+        ename = rb_id2name(SYM2ID(name));
+        if (strlen(ename) != dr->str_len || 0 != memcmp(dr->str, ename, dr->str_len)) {
             sax_drive_error(dr, "invalid format, element start and end names do not match", 1);
             return -1;
         }
-        if (0 != dr->has_end_element) {
+        if (0 != dr->has.end_element) {
             VALUE       args[1];
 
             args[0] = name;
-            rb_funcall2(dr->handler, ox_end_element_id, 1, args);
+            sax_call(dr, ox_end_element_id, 1, args);
         }
     }
     dr->str = 0;
@@ -686,44 +1183,148 @@ read_element(SaxDrive dr) {
     return 0;
 }
 
+/* Reads up to and including the '>' at the end of a start tag, skipping over
+ * quoted attribute values. Returns '/' for an empty element tag, '>'
+ * otherwise or '\0' at the end of the document.
+ */
+static char
+skip_tag(SaxDrive dr) {
+    char        c;
+    char        prev = '\0';
+
+    while ('\0' != (c = sax_drive_get(dr))) {
+        if ('"' == c || '\'' == c) {
+            char        term = c;
+
+            while (term != (c = sax_drive_get(dr))) {
+                if ('\0' == c) {
+                    return '\0';
+                }
+            }
+        } else if ('>' == c) {
+            return ('/' == prev) ? '/' : '>';
+        }
+        prev = c;
+    }
+    return '\0';
+}
+
+/* Reads past the next occurrence of term which must be one character
+ * repeated and then a different last character such as "-->". Returns 0 if
+ * found.
+ */
 static int
-read_text(SaxDrive dr) {
+skip_past(SaxDrive dr, const char *term) {
+    size_t      len = strlen(term);
+    size_t      matched = 0;
     char        c;
 
-    dr->str = dr->cur - 1; // mark the start
-    while ('<' != (c = sax_drive_get(dr))) {
-        if ('\0' == c) {
-            sax_drive_error(dr, "invalid format, text terminated unexpectedly", 1);
+    while ('\0' != (c = sax_drive_get(dr))) {
+        if (c == term[matched]) {
+            if (len == ++matched) {
+                return 0;
+            }
+        } else if (c != *term) {
+            matched = 0;
+        }
+    }
+    return -1;
+}
+
+/* Skips the rest of an element and everything in it without reading names or
+ * making callbacks. Only the nesting depth is tracked so end tags are not
+ * checked against the start tags. Entered after the element name with c the
+ * character that ended the name.
+ */
+static int
+skip_element(SaxDrive dr, char c) {
+    long        depth = 1;
+
+    dr->str = 0; // nothing needs to be kept
+    if ('/' == c) {
+        c = next_non_white(dr);
+        if ('>' != c) {
+            sax_drive_error(dr, "invalid format, element not closed", 1);
             return -1;
         }
+        return 0;
+    }
+    if ('>' != c && '/' == (c = skip_tag(dr))) {
+        return 0;
     }
-    *(dr->cur - 1) = '\0';
-    if (dr->has_value) {
+    while ('\0' != c) {
+        if ('\0' == scan_to_char(dr, '<')) {
+            break;
+        }
+        dr->cur++;
+        switch (c = sax_drive_get(dr)) {
+        case '/':
+            if ('\0' == (c = skip_tag(dr))) {
+                break;
+            }
+            if (0 == --depth) {
+                return 0;
+            }
+            break;
+        case '!':
+            c = sax_drive_get(dr);
+            if ('-' == c) {
+                c = (0 == skip_past(dr, "-->")) ? '>' : '\0';
+            } else if ('[' == c) {
+                c = (0 == skip_past(dr, "]]>")) ? '>' : '\0';
+            } else if ('\0' != c) {
+                c = skip_tag(dr);
+            }
+            break;
+        case '?':
+            c = (0 == skip_past(dr, "?>")) ? '>' : '\0';
+            break;
+        case '\0':
+            break;
+        default:
+            if ('>' == (c = skip_tag(dr))) {
+                depth++;
+            }
+            break;
+        }
+    }
+    sax_drive_error(dr, "invalid format, element not terminated", 1);
+
+    return -1;
+}
+
+static int
+read_text(SaxDrive dr) {
+    dr->str = dr->cur - 1; // mark the start
+    if ('\0' == scan_to_char(dr, '<')) {
+        sax_drive_error(dr, "invalid format, text terminated unexpectedly", 1);
+        return -1;
+    }
+    sax_term(dr, dr->cur);
+    dr->cur++;
+    if (dr->has.value) {
         VALUE   args[1];
 
 	*args = dr->value_obj;
-        rb_funcall2(dr->handler, ox_value_id, 1, args);
-    } else if (dr->has_text) {
+        dr->collapsed = 0;
+        sax_call(dr, ox_value_id, 1, args);
+    } else if (dr->has.text) {
         VALUE   args[1];
 
         if (dr->convert_special) {
-            if (0 != collapse_special(dr->str) && 0 != strchr(dr->str, '&')) {
-                sax_drive_error(dr, "invalid format, special character does not end with a semicolon", 0);
-            }
+            sax_collapse(dr);
         }
-        args[0] = rb_str_new2(dr->str);
-#if HAS_ENCODING_SUPPORT
-        if (0 != dr->encoding) {
-            rb_enc_associate(args[0], dr->encoding);
-        }
-#endif
-        rb_funcall2(dr->handler, ox_text_id, 1, args);
+        args[0] = sax_str_new(dr);
+        sax_call(dr, ox_text_id, 1, args);
     }
     return 0;
 }
 
+/* Reads attributes up to the termination character. If attrs is not Qnil the
+ * attributes are added to it instead of being passed to the attr callbacks.
+ */
 static int
-read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml) {
+read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml, VALUE attrs) {
     VALUE       name = Qnil;
     int         is_encoding = 0;
     
@@ -740,12 +1341,11 @@ read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml) {
         if ('\0' == (c = read_name_token(dr))) {
             return -1;
         }
-        if (is_xml && 0 == strcmp("encoding", dr->str)) {
+        if (is_xml && 8 == dr->str_len && 0 == strncmp("encoding", dr->str, 8)) {
             is_encoding = 1;
         }
-	// TBD use symbol cache
-        if (dr->has_attr || dr->has_attr_value) {
-            name = str2sym(dr->str, dr);
+        if (dr->has.attr || dr->has.attr_value || Qnil != attrs) {
+            name = str2sym(dr->str, dr->str_len, dr);
         }
         if (is_white(c)) {
             c = next_non_white(dr);
@@ -759,29 +1359,26 @@ read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml) {
         }
 #if HAS_ENCODING_SUPPORT
         if (is_encoding) {
-            dr->encoding = rb_enc_find(dr->str);
+            dr->encoding = rb_enc_find(sax_cstr(dr));
         }
 #endif
-        if (dr->has_attr_value) {
+        if (Qnil != attrs) {
+            sax_collapse(dr);
+            rb_hash_aset(attrs, name, sax_str_new(dr));
+        } else if (dr->has.attr_value) {
             VALUE       args[2];
 
             args[0] = name;
             args[1] = dr->value_obj;
-            rb_funcall2(dr->handler, ox_attr_value_id, 2, args);
-	} else if (dr->has_attr) {
+            dr->collapsed = 0;
+            sax_call(dr, ox_attr_value_id, 2, args);
+	} else if (dr->has.attr) {
             VALUE       args[2];
 
             args[0] = name;
-            if (0 != collapse_special(dr->str) && 0 != strchr(dr->str, '&')) {
-                sax_drive_error(dr, "invalid format, special character does not end with a semicolon", 0);
-            }
-            args[1] = rb_str_new2(dr->str);
-#if HAS_ENCODING_SUPPORT
-            if (0 != dr->encoding) {
-                rb_enc_associate(args[1], dr->encoding);
-            }
-#endif
-            rb_funcall2(dr->handler, ox_attr_id, 2, args);
+            sax_collapse(dr);
+            args[1] = sax_str_new(dr);
+            sax_call(dr, ox_attr_id, 2, args);
         }
         c = next_non_white(dr);
     }
@@ -809,7 +1406,7 @@ read_name_token(SaxDrive dr) {
 	case '>':
 	case '\n':
 	case '\r':
-            *(dr->cur - 1) = '\0';
+            sax_term(dr, dr->cur - 1);
 	    return c;
 	case '\0':
             // documents never terminate after a name token
@@ -818,6 +1415,13 @@ read_name_token(SaxDrive dr) {
 	default:
 	    break;
 	}
+        // jump to the next character that can end the name
+        while (0 == sax_drive_fill(dr)) {
+            dr->cur = (char*)ox_scan_name(dr->cur, dr->read_end);
+            if (dr->cur < dr->read_end) {
+                break;
+            }
+        }
         c = sax_drive_get(dr);
     }
     return '\0';
@@ -836,19 +1440,18 @@ read_quoted_value(SaxDrive dr) {
 	char	term = c;
 
         dr->str = dr->cur;
-        while (term != (c = sax_drive_get(dr))) {
-            if ('\0' == c) {
-                sax_drive_error(dr, "invalid format, quoted value not terminated", 1);
-                return -1;
-            }
+        if ('\0' == scan_to_char(dr, term)) {
+            sax_drive_error(dr, "invalid format, quoted value not terminated", 1);
+            return -1;
         }
+        dr->cur++;
     } else {
         dr->str = dr->cur - 1;
         if ('\0' == (c = next_white(dr))) {
 	    sax_drive_error(dr, "invalid format, attibute value not in quotes", 1);
 	}
     }        
-    *(dr->cur - 1) = '\0'; // terminate value
+    sax_term(dr, dr->cur - 1); // terminate value
     return 0;
 }
 
@@ -864,51 +1467,59 @@ rescue_cb(VALUE rdr, VALUE err) {
     if (rb_obj_class(err) != rb_eEOFError) {
 #endif
 	SaxDrive	dr = (SaxDrive)rdr;
+        volatile VALUE	msg = rb_funcall(err, ox_message_id, 0);
+        int		line;
+        int		col;
 
-        sax_drive_cleanup(dr);
-        rb_raise(err, "at line %d, column %d\n", dr->line, dr->col);
+        sax_drive_position(dr, dr->cur, &line, &col);
+        // err is an instance so raise its class with the position added
+        rb_raise(rb_obj_class(err), "%s at line %d, column %d\n", StringValuePtr(msg), line, col);
     }
 #endif
     return Qfalse;
 }
 
+/* Reads with the given method into dr->rbuf so that the same Ruby String is
+ * filled each time instead of a new one being made for every read. The
+ * String returned is used in case the IO ignores the buffer.
+ */
 static VALUE
-partial_io_cb(VALUE rdr) {
-    SaxDrive    dr = (SaxDrive)rdr;
-    VALUE       args[1];
-    VALUE       rstr;
-    char        *str;
-    size_t      cnt;
+io_read(SaxDrive dr, ID method) {
+    VALUE           args[2];
+    volatile VALUE  rstr;
+    size_t          cnt;
 
     args[0] = ULONG2NUM(dr->buf_end - dr->cur);
-    rstr = rb_funcall2(dr->io, ox_readpartial_id, 1, args);
-    str = StringValuePtr(rstr);
-    cnt = strlen(str);
-    //printf("*** read %lu bytes, str: '%s'\n", cnt, str);
-    strcpy(dr->cur, str);
+    args[1] = dr->rbuf;
+    rstr = rb_funcall2(dr->io, method, (Qnil == dr->rbuf) ? 1 : 2, args);
+    if (Qnil == rstr) { // read() returns nil at the end
+        return Qfalse;
+    }
+    cnt = RSTRING_LEN(StringValue(rstr));
+    if (dr->buf_end - dr->cur < (long)cnt) {
+        // the reader returned more than was asked for so make room for all of it
+        size_t  size = (dr->cur - dr->buf) + cnt;
+
+        if (0 < dr->buf_max && dr->buf_max < size) {
+            rb_raise(rb_eIOError, "%s returned %lu bytes, more than the %lu byte maximum buffer size holds\n",
+                     rb_id2name(method), (unsigned long)cnt, (unsigned long)dr->buf_max);
+        }
+        sax_drive_resize(dr, size);
+    }
+    memcpy(dr->cur, RSTRING_PTR(rstr), cnt);
     dr->read_end = dr->cur + cnt;
 
     return Qtrue;
 }
 
 static VALUE
-io_cb(VALUE rdr) {
-    SaxDrive    dr = (SaxDrive)rdr;
-    VALUE       args[1];
-    VALUE       rstr;
-    char        *str;
-    size_t      cnt;
-
-    args[0] = ULONG2NUM(dr->buf_end - dr->cur);
-    //args[0] = SIZET2NUM(dr->buf_end - dr->cur);
-    rstr = rb_funcall2(dr->io, ox_read_id, 1, args);
-    str = StringValuePtr(rstr);
-    cnt = strlen(str);
-    //printf("*** read %lu bytes, str: '%s'\n", cnt, str);
-    strcpy(dr->cur, str);
-    dr->read_end = dr->cur + cnt;
+partial_io_cb(VALUE rdr) {
+    return io_read((SaxDrive)rdr, ox_readpartial_id);
+}
 
-    return Qtrue;
+static VALUE
+io_cb(VALUE rdr) {
+    return io_read((SaxDrive)rdr, ox_read_id);
 }
 
 static int
@@ -921,6 +1532,43 @@ read_from_io(SaxDrive dr) {
     return (Qfalse == rb_rescue(io_cb, (VALUE)dr, rescue_cb, (VALUE)dr));
 }
 
+#if SAX_MMAP
+/* Maps a regular file from the current position to the end so that it can be
+ * scanned in place without reads or compaction. Returns non-zero if the file
+ * is a pipe or socket, is small enough to read in one go or can not be
+ * mapped.
+ */
+static int
+map_fd(SaxDrive dr) {
+    struct stat st;
+    off_t       pos;
+    off_t       start;
+
+    if (0 != fstat(dr->fd, &st) || !S_ISREG(st.st_mode) ||
+        0 > (pos = lseek(dr->fd, 0, SEEK_CUR)) ||
+        st.st_size - pos <= (off_t)sizeof(dr->base_buf)) {
+        return -1;
+    }
+    // mappings must start on a page boundary
+    start = pos - pos % sysconf(_SC_PAGESIZE);
+    dr->map_size = (size_t)(st.st_size - start);
+    dr->map = (char*)mmap(0, dr->map_size, PROT_READ, MAP_PRIVATE, dr->fd, start);
+    if (MAP_FAILED == (void*)dr->map) {
+        dr->map = 0;
+        return -1;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(dr->map, dr->map_size, MADV_SEQUENTIAL);
+#endif
+    // leave the file at the end as if it had been read
+    lseek(dr->fd, st.st_size, SEEK_SET);
+    dr->buf = dr->map + (pos - start);
+    dr->buf_end = dr->map + dr->map_size;
+
+    return 0;
+}
+#endif
+
 #ifndef JRUBY_RUBY
 static int
 read_from_fd(SaxDrive dr) {
@@ -938,25 +1586,6 @@ read_from_fd(SaxDrive dr) {
 }
 #endif
 
-static int
-read_from_str(SaxDrive dr) {
-    size_t      max = dr->buf_end - dr->cur - 1;
-    char	*s;
-    long	cnt;
-
-    if ('\0' == *dr->in_str) {
-	// done
-	return -1;
-    }
-    s = stpncpy(dr->cur, dr->in_str, max);
-    *s = '\0';
-    cnt = s - dr->cur;
-    dr->in_str += cnt;
-    dr->read_end = dr->cur + cnt;
-
-    return 0;
-}
-
 static int
 collapse_special(char *str) {
     char        *s = str;
@@ -1014,157 +1643,122 @@ collapse_special(char *str) {
     return 0;
 }
 
-static VALUE
-parse_double_time(const char *text) {
-    long        v = 0;
-    long        v2 = 0;
-    const char  *dot = 0;
-    char        c;
-    
-    for (; '.' != *text; text++) {
-        c = *text;
-        if (c < '0' || '9' < c) {
-            return Qnil;
-        }
-        v = 10 * v + (long)(c - '0');
-    }
-    dot = text++;
-    for (; '\0' != *text && text - dot <= 6; text++) {
-        c = *text;
-        if (c < '0' || '9' < c) {
-            return Qnil;
-        }
-        v2 = 10 * v2 + (long)(c - '0');
-    }
-    for (; text - dot <= 9; text++) {
-        v2 *= 10;
+/* Converts special characters such as &lt; once per value if the
+ * convert_special option is set. Every conversion calls this first so they
+ * all see the same text.
+ */
+inline static void
+value_collapse(SaxDrive dr) {
+    if (dr->convert_special && !dr->collapsed) {
+	sax_collapse(dr);
+	dr->collapsed = 1;
     }
-#if HAS_NANO_TIME
-    return rb_time_nano_new(v, v2);
-#else
-    return rb_time_new(v, v2 / 1000);
-#endif
 }
 
-typedef struct _Tp {
-    int         cnt;
-    char        end;
-    char        alt;
-} *Tp;
+/* A Value keeps the drive it reads from alive.
+ */
+static void
+sax_value_mark(void *ptr) {
+    rb_gc_mark(((SaxDrive)ptr)->self);
+}
 
-static VALUE
-parse_xsd_time(const char *text) {
-    long        cargs[10];
-    long        *cp = cargs;
-    long        v;
-    int         i;
-    char        c = '\0';
-    struct _Tp  tpa[10] = { { 4, '-', '-' },
-                           { 2, '-', '-' },
-                           { 2, 'T', ' ' },
-                           { 2, ':', ':' },
-                           { 2, ':', ':' },
-                           { 2, '.', '.' },
-                           { 9, '+', '-' },
-                           { 2, ':', ':' },
-                           { 2, '\0', '\0' },
-                           { 0, '\0', '\0' } };
-    Tp          tp = tpa;
-    struct tm   tm;
-
-    memset(cargs, 0, sizeof(cargs));
-    for (; 0 != tp->cnt; tp++) {
-        for (i = tp->cnt, v = 0; 0 < i ; text++, i--) {
-            c = *text;
-            if (c < '0' || '9' < c) {
-                if ('\0' == c || tp->end == c || tp->alt == c) {
-                    break;
-                }
-		return Qnil;
-            }
-            v = 10 * v + (long)(c - '0');
-        }
-	if ('\0' == c) {
-	    break;
-	}
-        c = *text++;
-        if (tp->end != c && tp->alt != c) {
-	    return Qnil;
-        }
-        *cp++ = v;
-    }
-    tm.tm_year = (int)cargs[0] - 1900;
-    tm.tm_mon = (int)cargs[1] - 1;
-    tm.tm_mday = (int)cargs[2];
-    tm.tm_hour = (int)cargs[3];
-    tm.tm_min = (int)cargs[4];
-    tm.tm_sec = (int)cargs[5];
-#if HAS_NANO_TIME
-    return rb_time_nano_new(mktime(&tm), cargs[6]);
-#else
-    return rb_time_new(mktime(&tm), cargs[6] / 1000);
-#endif
+/* Returns the text to compare with a String or Symbol without making a new
+ * Ruby object.
+ */
+static const char*
+value_arg(VALUE arg, long *lenp) {
+    if (T_SYMBOL == rb_type(arg)) {
+	const char	*name = rb_id2name(SYM2ID(arg));
+
+	*lenp = (long)strlen(name);
+	return name;
+    }
+    StringValue(arg);
+    *lenp = RSTRING_LEN(arg);
+
+    return RSTRING_PTR(arg);
 }
 
+/* call-seq: as_s()
+ *
+ * Returns the value as a new String or nil if empty.
+ */
 static VALUE
 sax_value_as_s(VALUE self) {
     SaxDrive	dr = DATA_PTR(self);
-    VALUE	rs;
 
-    if ('\0' == *dr->str) {
+    if (0 == dr->str_len) {
 	return Qnil;
     }
-    if (dr->convert_special) {
-	if (0 != collapse_special(dr->str) && 0 != strchr(dr->str, '&')) {
-	    sax_drive_error(dr, "invalid format, special character does not end with a semicolon", 0);
-	}
-    }
-    rs = rb_str_new2(dr->str);
-#if HAS_ENCODING_SUPPORT
-    if (0 != dr->encoding) {
-	rb_enc_associate(rs, dr->encoding);
-    }
-#endif
-    return rs;
+    value_collapse(dr);
+
+    return sax_str_new(dr);
 }
 
+/* call-seq: as_sym()
+ *
+ * Returns the value as a Symbol or nil if empty.
+ */
 static VALUE
 sax_value_as_sym(VALUE self) {
     SaxDrive	dr = DATA_PTR(self);
 
-    if ('\0' == *dr->str) {
+    if (0 == dr->str_len) {
 	return Qnil;
     }
-    return str2sym(dr->str, dr);
+    value_collapse(dr);
+
+    return str2sym(dr->str, dr->str_len, dr);
 }
 
+/* call-seq: as_f()
+ *
+ * Returns the value as a Float or nil if empty.
+ */
 static VALUE
 sax_value_as_f(VALUE self) {
     SaxDrive	dr = DATA_PTR(self);
 
-    if ('\0' == *dr->str) {
+    if (0 == dr->str_len) {
 	return Qnil;
     }
-    return rb_float_new(strtod(dr->str, 0));
+    value_collapse(dr);
+
+    return rb_float_new(ox_str_to_dbl(dr->str, dr->str + dr->str_len));
 }
 
+/* call-seq: as_i()
+ *
+ * Returns the value as an Integer or nil if empty. Raises an ArgumentError if
+ * the value is not an integer.
+ */
 static VALUE
 sax_value_as_i(VALUE self) {
     SaxDrive	dr = DATA_PTR(self);
-    const char	*s = dr->str;
+    const char	*s;
+    const char	*end;
     long	n = 0;
     int		neg = 0;
 
-    if ('\0' == *s) {
+    if (0 == dr->str_len) {
 	return Qnil;
     }
+    value_collapse(dr);
+    s = dr->str;
+    end = s + dr->str_len;
     if ('-' == *s) {
 	neg = 1;
 	s++;
     } else if ('+' == *s) {
 	s++;
     }
-    for (; '\0' != *s; s++) {
+    if (s == end) {
+	rb_raise(rb_eArgError, "Not a valid Fixnum.\n");
+    }
+    if (18 < end - s) { // might not fit in a long
+	return rb_cstr_to_inum(sax_cstr(dr), 10, 1);
+    }
+    for (; s < end; s++) {
 	if ('0' <= *s && *s <= '9') {
 	    n = n * 10 + (*s - '0');
 	} else {
@@ -1177,41 +1771,124 @@ sax_value_as_i(VALUE self) {
     return LONG2NUM(n);
 }
 
+/* call-seq: as_time()
+ *
+ * Returns the value as a Time or nil if empty. Seconds since the epoch and
+ * xsd:dateTime formats are read directly, keeping any UTC offset given, and
+ * anything else is handed to Time.parse().
+ */
 static VALUE
 sax_value_as_time(VALUE self) {
     SaxDrive	dr = DATA_PTR(self);
-    const char	*str = dr->str;
+    const char	*str;
+    const char	*end;
     VALUE       t;
 
-    if ('\0' == *str) {
+    if (0 == dr->str_len) {
 	return Qnil;
     }
-    if (Qnil == (t = parse_double_time(str)) &&
-	Qnil == (t = parse_xsd_time(str))) {
+    value_collapse(dr);
+    str = dr->str;
+    end = str + dr->str_len;
+    if (Qnil == (t = ox_time_parse(str, end))) {
         VALUE       args[1];
 
         //printf("**** time parse\n");
-        *args = rb_str_new2(str);
+        *args = rb_str_new(str, dr->str_len);
         t = rb_funcall2(ox_time_class, ox_parse_id, 1, args);
     }
     return t;
 }
 
+/* call-seq: as_bool()
+ *
+ * Returns true if the value is "true", ignoring case, and false otherwise.
+ */
 static VALUE
 sax_value_as_bool(VALUE self) {
-    return (0 == strcasecmp("true", ((SaxDrive)DATA_PTR(self))->str)) ? Qtrue : Qfalse;
+    SaxDrive	dr = DATA_PTR(self);
+
+    value_collapse(dr);
+
+    return (4 == dr->str_len && 0 == strncasecmp("true", dr->str, 4)) ? Qtrue : Qfalse;
 }
 
+/* call-seq: empty?()
+ *
+ * Returns true if the value is empty.
+ */
 static VALUE
 sax_value_empty(VALUE self) {
-    return ('\0' == *((SaxDrive)DATA_PTR(self))->str) ? Qtrue : Qfalse;
+    return (0 == ((SaxDrive)DATA_PTR(self))->str_len) ? Qtrue : Qfalse;
+}
+
+/* call-seq: ==(str)
+ *
+ * Returns true if the value is the same as the String or Symbol given. The
+ * comparison is made against the document text so no String is made.
+ * @param [String|Symbol] str value to compare with
+ */
+static VALUE
+sax_value_equal(VALUE self, VALUE str) {
+    SaxDrive	dr = DATA_PTR(self);
+    const char	*s;
+    long	len;
+
+    if (T_STRING != rb_type(str) && T_SYMBOL != rb_type(str)) {
+	return Qfalse;
+    }
+    value_collapse(dr);
+    s = value_arg(str, &len);
+
+    return ((size_t)len == dr->str_len && 0 == memcmp(s, dr->str, len)) ? Qtrue : Qfalse;
+}
+
+/* call-seq: start_with?(prefix)
+ *
+ * Returns true if the value starts with the String or Symbol given. No String
+ * is made for the value.
+ * @param [String|Symbol] prefix value to compare with the start of the value
+ */
+static VALUE
+sax_value_start_with(VALUE self, VALUE prefix) {
+    SaxDrive	dr = DATA_PTR(self);
+    const char	*s;
+    long	len;
+
+    value_collapse(dr);
+    s = value_arg(prefix, &len);
+
+    return ((size_t)len <= dr->str_len && 0 == memcmp(s, dr->str, len)) ? Qtrue : Qfalse;
+}
+
+/* call-seq: skip!()
+ *
+ * Called from start_element() to skip the rest of the element. Nothing in
+ * the element is reported and end_element() is called next. The contents are
+ * passed over without being parsed so end tags are not checked. It has no
+ * effect when called from any other callback or when events are batched.
+ */
+static VALUE
+sax_skip(VALUE self) {
+    VALUE	drive = rb_attr_get(self, ox_drive_id);
+
+    if (Qnil != drive) {
+	((SaxDrive)DATA_PTR(drive))->skip = 1;
+    }
+    return Qnil;
 }
 
 void
 ox_sax_define() {
     VALUE	sax_module = rb_const_get_at(Ox, rb_intern("Sax"));
 
+    sax_class = sax_module;
+    // no @ so it can not be seen or changed from Ruby
+    ox_drive_id = rb_intern("drive");
+    rb_define_method(sax_module, "skip!", sax_skip, 0);
+
     sax_value_class = rb_define_class_under(sax_module, "Value", rb_cObject);
+    rb_undef_alloc_func(sax_value_class);
 
     rb_define_method(sax_value_class, "as_s", sax_value_as_s, 0);
     rb_define_method(sax_value_class, "as_sym", sax_value_as_sym, 0);
@@ -1220,4 +1897,6 @@ ox_sax_define() {
     rb_define_method(sax_value_class, "as_time", sax_value_as_time, 0);
     rb_define_method(sax_value_class, "as_bool", sax_value_as_bool, 0);
     rb_define_method(sax_value_class, "empty?", sax_value_empty, 0);
+    rb_define_method(sax_value_class, "==", sax_value_equal, 1);
+    rb_define_method(sax_value_class, "start_with?", sax_value_start_with, 1);
 }
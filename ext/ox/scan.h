@@ -0,0 +1,259 @@
+/* scan.h
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OX_SCAN_H__
+#define __OX_SCAN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define OX_SCAN_SSE2	1
+#include <emmintrin.h>
+#else
+#define OX_SCAN_SSE2	0
+#endif
+
+/* Character classes used by the scanners. Each byte value maps to a set of
+ * flags in ox_scan_class.
+ */
+#define SCAN_WHITE	0x01	// ' ', \t, \f, \n, \r
+#define SCAN_TEXT	0x02	// <, &
+#define SCAN_NAME	0x04	// white, ?, =, /, >
+
+extern const unsigned char	ox_scan_class[256];
+
+#define scan_is(c, flag)	(0 != (ox_scan_class[(unsigned char)(c)] & (flag)))
+
+#if OX_SCAN_SSE2
+inline static __m128i
+sse_white(__m128i v) {
+    __m128i	m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\f')));
+
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+}
+
+// Returns s plus the offset of the first set bit in mask or end if that is
+// past the end.
+inline static const char*
+sse_found(const char *s, const char *end, int mask) {
+    s += __builtin_ctz(mask);
+
+    return (s < end) ? s : end;
+}
+#endif
+
+/* All the scanners take the end of the buffer and return it if nothing is
+ * found. They step one byte at a time until the pointer is 16 byte aligned
+ * and then check 16 bytes at a time. An aligned load never crosses a page
+ * boundary so reading a block that holds at least one byte before end is safe
+ * even if the rest of the block is past the end of the buffer. Matches past
+ * the end are ignored. Short tokens are usually found before the aligned loop
+ * is reached.
+ */
+
+/* Returns a pointer to the first character that is not white space.
+ */
+inline static const char*
+ox_skip_white(const char *s, const char *end) {
+#if OX_SCAN_SSE2
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (!scan_is(*s, SCAN_WHITE)) {
+	    return s;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	int	mask = ~_mm_movemask_epi8(sse_white(v)) & 0x0000FFFF;
+
+	if (0 != mask) {
+	    return sse_found(s, end, mask);
+	}
+    }
+    return end;
+#else
+    for (; s < end && scan_is(*s, SCAN_WHITE); s++) {
+    }
+    return s;
+#endif
+}
+
+/* Returns a pointer to the first white space character.
+ */
+inline static const char*
+ox_scan_white(const char *s, const char *end) {
+#if OX_SCAN_SSE2
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (scan_is(*s, SCAN_WHITE)) {
+	    return s;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	int	mask = _mm_movemask_epi8(sse_white(v));
+
+	if (0 != mask) {
+	    return sse_found(s, end, mask);
+	}
+    }
+    return end;
+#else
+    for (; s < end && !scan_is(*s, SCAN_WHITE); s++) {
+    }
+    return s;
+#endif
+}
+
+/* Returns a pointer to the first '<' or '&'.
+ */
+inline static const char*
+ox_scan_text(const char *s, const char *end) {
+#if OX_SCAN_SSE2
+    const __m128i	lt = _mm_set1_epi8('<');
+    const __m128i	amp = _mm_set1_epi8('&');
+
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (scan_is(*s, SCAN_TEXT)) {
+	    return s;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	int	mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp)));
+
+	if (0 != mask) {
+	    return sse_found(s, end, mask);
+	}
+    }
+    return end;
+#else
+    for (; s < end && !scan_is(*s, SCAN_TEXT); s++) {
+    }
+    return s;
+#endif
+}
+
+/* Returns a pointer to the first character that terminates a name token,
+ * white space, '?', '=', '/', or '>'.
+ */
+inline static const char*
+ox_scan_name(const char *s, const char *end) {
+#if OX_SCAN_SSE2
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (scan_is(*s, SCAN_NAME)) {
+	    return s;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	__m128i	m = sse_white(v);
+	int	mask;
+
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+	if (0 != (mask = _mm_movemask_epi8(m))) {
+	    return sse_found(s, end, mask);
+	}
+    }
+    return end;
+#else
+    for (; s < end && !scan_is(*s, SCAN_NAME); s++) {
+    }
+    return s;
+#endif
+}
+
+/* Returns a pointer to the first term character.
+ */
+inline static const char*
+ox_scan_char(const char *s, const char *end, char term) {
+#if OX_SCAN_SSE2
+    const __m128i	t = _mm_set1_epi8(term);
+
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (term == *s) {
+	    return s;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	int	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, t));
+
+	if (0 != mask) {
+	    return sse_found(s, end, mask);
+	}
+    }
+    return end;
+#else
+    for (; s < end && term != *s; s++) {
+    }
+    return s;
+#endif
+}
+
+/* Returns the number of c characters between s and end.
+ */
+inline static size_t
+ox_count_char(const char *s, const char *end, char c) {
+    size_t	cnt = 0;
+#if OX_SCAN_SSE2
+    const __m128i	t = _mm_set1_epi8(c);
+
+    for (; s < end && 0 != ((uintptr_t)s & 0x0F); s++) {
+	if (c == *s) {
+	    cnt++;
+	}
+    }
+    for (; s < end; s += 16) {
+	__m128i	v = _mm_load_si128((const __m128i*)s);
+	int	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, t));
+
+	if (end - s < 16) { // drop matches past the end
+	    mask &= (1 << (end - s)) - 1;
+	}
+	cnt += __builtin_popcount(mask);
+    }
+#else
+    for (; s < end; s++) {
+	if (c == *s) {
+	    cnt++;
+	}
+    }
+#endif
+    return cnt;
+}
+
+#endif /* __OX_SCAN_H__ */
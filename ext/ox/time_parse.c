@@ -0,0 +1,271 @@
+/* time_parse.c
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include "ruby.h"
+#include "time_parse.h"
+
+#define SECS_PER_DAY	86400L
+
+/* Returns the value of cnt digits or -1 if any of them are not digits.
+ */
+inline static int
+read_digits(const char *s, int cnt) {
+    int		v = 0;
+
+    for (; 0 < cnt; cnt--, s++) {
+	unsigned int	d = (unsigned int)(*s - '0');
+
+	if (9 < d) {
+	    return -1;
+	}
+	v = v * 10 + (int)d;
+    }
+    return v;
+}
+
+/* Returns the days since 1970-01-01 for a date in the proleptic Gregorian
+ * calendar. Years are counted from March so the leap day is last.
+ */
+static long
+days_from_civil(long y, int m, int d) {
+    long	era;
+    long	yoe;
+    long	doy;
+
+    if (m <= 2) {
+	y--;
+    }
+    era = (0 <= y ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (2 < m ? -3 : 9)) + 2) / 5 + d - 1;
+
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* Returns the number of days in a month of the proleptic Gregorian calendar.
+ */
+inline static int
+days_in_month(int year, int mon) {
+    static const char	days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if (2 == mon && 0 == year % 4 && (0 != year % 100 || 0 == year % 400)) {
+	return 29;
+    }
+    return days[mon - 1];
+}
+
+/* Returns the local UTC offset at t by reading the local wall clock time as
+ * if it were UTC. Nothing is kept between calls so it is safe from any thread
+ * and tm_gmtoff, which not every platform has, is not needed.
+ */
+static long
+local_offset(time_t t) {
+    struct tm	tm;
+
+    if (0 == localtime_r(&t, &tm)) {
+	return 0;
+    }
+    return days_from_civil(tm.tm_year + 1900L, tm.tm_mon + 1, tm.tm_mday) * SECS_PER_DAY +
+	tm.tm_hour * 3600L + tm.tm_min * 60L + tm.tm_sec - (long)t;
+}
+
+int
+ox_xsd_time_parse(const char *text, const char *end, time_t *secp, long *nsecp, long *offp, int *zonep) {
+    const char	*s = text;
+    int		year, mon, day;
+    int		hour = 0, min = 0, sec = 0;
+    long	nsec = 0;
+    long	off = 0;
+    int		zone = 0;
+    time_t	t;
+
+    if (end - s < 10 || '-' != s[4] || '-' != s[7]) {
+	return -1;
+    }
+    year = read_digits(s, 4);
+    mon = read_digits(s + 5, 2);
+    day = read_digits(s + 8, 2);
+    s += 10;
+    if (s < end) {
+	if (end - s < 6 || ('T' != *s && ' ' != *s) || ':' != s[3]) {
+	    return -1;
+	}
+	hour = read_digits(s + 1, 2);
+	min = read_digits(s + 4, 2);
+	s += 6;
+	if (s < end && ':' == *s) {
+	    if (end - s < 3) {
+		return -1;
+	    }
+	    sec = read_digits(s + 1, 2);
+	    s += 3;
+	    if (s < end && '.' == *s) {
+		long	scale = 100000000L;
+
+		// digits past nanoseconds are dropped
+		for (s++; s < end && (unsigned int)(*s - '0') <= 9; s++) {
+		    nsec += (*s - '0') * scale;
+		    scale /= 10;
+		}
+	    }
+	}
+	if (s < end) {
+	    if ('Z' == *s) {
+		zone = 1;
+		s++;
+	    } else if ('+' == *s || '-' == *s) {
+		int	oh;
+		int	om = 0;
+		int	neg = ('-' == *s);
+
+		if (end - s < 3 || 23 < (unsigned int)(oh = read_digits(s + 1, 2))) {
+		    return -1;
+		}
+		s += 3;
+		if (s < end && ':' == *s) {
+		    s++;
+		}
+		if (s < end) {
+		    if (end - s < 2 || 59 < (unsigned int)(om = read_digits(s, 2))) {
+			return -1;
+		    }
+		    s += 2;
+		}
+		off = oh * 3600L + om * 60L;
+		if (neg) {
+		    off = -off;
+		}
+		zone = 1;
+	    }
+	}
+    }
+    // a negative value from read_digits() fails the unsigned range checks
+    if (s != end || 0 > year ||
+	(unsigned int)(mon - 1) > 11 || 0 >= day || days_in_month(year, mon) < day ||
+	(unsigned int)hour > 23 || (unsigned int)min > 59 || (unsigned int)sec > 60) {
+	return -1;
+    }
+    t = (time_t)(days_from_civil(year, mon, day) * SECS_PER_DAY + hour * 3600L + min * 60L + sec);
+    if (zone) {
+	t -= off;
+    } else {
+	// The offset at the wall clock time is close enough to find the
+	// right one except right at a daylight savings change.
+	off = local_offset(t);
+	off = local_offset(t - off);
+	t -= off;
+    }
+    *secp = t;
+    *nsecp = nsec;
+    *offp = off;
+    *zonep = zone;
+
+    return 0;
+}
+
+static VALUE
+time_new(time_t sec, long nsec, long off, int zone) {
+#ifdef HAVE_RB_TIME_TIMESPEC_NEW
+    struct timespec	ts;
+
+    ts.tv_sec = sec;
+    ts.tv_nsec = nsec;
+    // keep the offset given in the text, INT_MAX - 1 is UTC and INT_MAX is local
+    return rb_time_timespec_new(&ts, zone ? (0 == off ? INT_MAX - 1 : (int)off) : INT_MAX);
+#elif HAS_NANO_TIME
+    return rb_time_nano_new(sec, nsec);
+#else
+    return rb_time_new(sec, nsec / 1000);
+#endif
+}
+
+VALUE
+ox_xsd_time_new(const char *text, const char *end) {
+    time_t	sec;
+    long	nsec;
+    long	off;
+    int		zone;
+
+    if (0 != ox_xsd_time_parse(text, end, &sec, &nsec, &off, &zone)) {
+	return Qnil;
+    }
+    return time_new(sec, nsec, off, zone);
+}
+
+/* Parses seconds since the epoch with a fraction of up to 9 digits such as
+ * 1325376000.123456789. Returns Qnil if text is not in that format.
+ */
+static VALUE
+parse_double_time(const char *text, const char *end) {
+    long        v = 0;
+    long        v2 = 0;
+    const char  *dot = 0;
+    char        c;
+    
+    for (; text < end && '.' != *text; text++) {
+        c = *text;
+        if (c < '0' || '9' < c) {
+            return Qnil;
+        }
+        v = 10 * v + (long)(c - '0');
+    }
+    if (end <= text) {
+        return Qnil;
+    }
+    dot = text++;
+    for (; text < end && text - dot <= 9; text++) {
+        c = *text;
+        if (c < '0' || '9' < c) {
+            return Qnil;
+        }
+        v2 = 10 * v2 + (long)(c - '0');
+    }
+    for (; text - dot <= 9; text++) {
+        v2 *= 10;
+    }
+#if HAS_NANO_TIME
+    return rb_time_nano_new(v, v2);
+#else
+    return rb_time_new(v, v2 / 1000);
+#endif
+}
+
+VALUE
+ox_time_parse(const char *text, const char *end) {
+    VALUE	t;
+
+    if (Qnil == (t = parse_double_time(text, end))) {
+	t = ox_xsd_time_new(text, end);
+    }
+    return t;
+}
@@ -0,0 +1,54 @@
+/* time_parse.h
+ * Copyright (c) 2012, Peter Ohler
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  - Neither the name of Peter Ohler nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OX_TIME_PARSE_H__
+#define __OX_TIME_PARSE_H__
+
+#include <time.h>
+#include "ruby.h"
+
+/* Parses an xsd:dateTime such as 2012-01-05T10:20:30.123456789+09:00 from
+ * the text up to end. The time and zone are optional. A 'Z' or numeric
+ * offset sets *offp to the offset in seconds and *zonep to 1, without a zone
+ * the time is local and *zonep is 0. Returns 0 on success or -1 if the text
+ * is not a complete date-time.
+ */
+extern int	ox_xsd_time_parse(const char *text, const char *end, time_t *secp, long *nsecp, long *offp, int *zonep);
+
+/* Returns a Time for text that is either seconds since the epoch with a
+ * fraction, such as 1325376000.123456789, or an xsd:dateTime. Returns Qnil if
+ * it is neither so the caller can try Time.parse().
+ */
+extern VALUE	ox_time_parse(const char *text, const char *end);
+
+/* Like ox_time_parse() but only accepts the xsd:dateTime format. */
+extern VALUE	ox_xsd_time_new(const char *text, const char *end);
+
+#endif /* __OX_TIME_PARSE_H__ */
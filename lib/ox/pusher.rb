@@ -0,0 +1,77 @@
+require 'fiber'
+
+module Ox
+  class Sax
+    # A push style front end to the SAX parser. Instead of handing
+    # Ox.sax_parse() an IO to pull from, chunks of the document are handed to
+    # the Pusher as they arrive with feed() and finish() is called once the
+    # last chunk has been fed. The handler callbacks are made from inside
+    # feed() and finish() as each chunk is parsed.<p/>
+    #
+    # The SAX driver runs on its own Fiber and reads through the Pusher's
+    # readpartial() method. When the driver has consumed all the data fed so
+    # far it is suspended where it stands, even in the middle of a token, and
+    # picks up from the same spot when the next chunk is fed. Nothing that has
+    # already been read is scanned again and no more than the driver's read
+    # buffer and the current chunk are held in memory. A Pusher that is
+    # dropped before finish() is called is collected along with the driver.<p/>
+    # @example
+    #
+    #  pusher = Ox::Sax::Pusher.new(MySax.new())
+    #  socket.each_chunk { |chunk| pusher.feed(chunk) }
+    #  pusher.finish()
+    class Pusher
+
+      # Create a new Pusher that will make callbacks on the handler.
+      # @param [Ox::Sax] handler SAX (responds to OX::Sax methods) like handler
+      # @param [Hash] options parse options, the same as for Ox.sax_parse()
+      def initialize(handler, options={})
+        @chunk = nil
+        @pos = 0
+        @done = false
+        @fiber = Fiber.new { Ox.sax_parse(handler, self, options) }
+        # run up to the first read so the next resume delivers a chunk
+        @fiber.resume()
+      end
+
+      # Parse the next chunk of the document. Returns once all of the chunk
+      # has been consumed.
+      # @param [String] chunk next part of the XML document
+      def feed(chunk)
+        raise IOError.new("feed after finish") if @done
+        @fiber.resume(chunk.to_s) if @fiber.alive?
+        self
+      end
+
+      # Signals the end of the document. Any remaining callbacks are made and
+      # an error is raised if the document is not complete.
+      def finish()
+        @done = true
+        @fiber.resume(nil) while @fiber.alive?
+        nil
+      end
+
+      # Called by the SAX driver to get more data. Suspends the driver until
+      # feed() or finish() is called when all the fed data has been read.
+      # @param [Fixnum] max maximum number of bytes to return
+      # @param [String] outbuf if given filled with the data and returned
+      def readpartial(max, outbuf=nil)
+        while @chunk.nil? || @chunk.bytesize <= @pos
+          raise EOFError if @done
+          @chunk = Fiber.yield()
+          @pos = 0
+          raise EOFError if @chunk.nil?
+        end
+        if 0 == @pos && @chunk.bytesize <= max
+          str = @chunk
+        else
+          str = @chunk.byteslice(@pos, max)
+        end
+        @pos += str.bytesize
+        return str if outbuf.nil?
+        outbuf.replace(str)
+      end
+
+    end # Pusher
+  end # Sax
+end # Ox
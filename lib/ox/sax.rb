@@ -31,6 +31,12 @@ module Ox
   # the text() method is ignored if the value() method is defined or
   # public. The same is true for attr() and attr_value().
   #
+  # An Ox::Sax::Value is only valid during the callback it is passed to. It
+  # reads the document text directly. as_i(), as_f(), as_sym(), as_time() and
+  # as_bool() make no String, and == and start_with?() compare without making
+  # one. Asking for the same conversion more than once in a callback returns
+  # the first result.
+  #
   #    def instruct(target); end
   #    def attr(name, str); end
   #    def attr_value(name, value); end
@@ -42,7 +48,26 @@ module Ox
   #    def start_element(name); end
   #    def end_element(name); end
   #
+  # If start_element() takes a second argument the attributes of the element
+  # are passed to it as a Hash of Symbol names and String values, as in the
+  # example above. The attr() and attr_value() methods are then only called
+  # for the attributes of instructions.
+  #
+  #    def start_element(name, attrs); end
+  #
+  # Calling skip!() from start_element() skips the rest of the element.
+  # Nothing inside it is reported and end_element() is called next.
+  #
+  # When parsing with the :batch option the callbacks above only select which
+  # events are collected and the events are delivered in groups to the
+  # events() method instead.
+  #
+  #    def events(list); end
+  #
   class Sax
+    # Loaded when first used since it needs Fiber which not all Rubies have.
+    autoload :Pusher, 'ox/pusher'
+
     # Create a new instance of the Sax handler class.
     def initialize()
     end
@@ -84,6 +109,9 @@ module Ox
     
     def error(message, line, column)
     end
+
+    def events(list)
+    end
     
   end # Sax
 end # Ox
@@ -24,7 +24,9 @@ class Perf
     @items.each do |i|
       i.run(iter, base.duration)
       if i.error.nil?
-        puts "#{i.title}.#{i.op} #{iter} times in %0.3f seconds or %0.3f #{i.op}/sec." % [i.duration, iter / i.duration]
+        line = "#{i.title}.#{i.op} #{iter} times in %0.3f seconds or %0.3f #{i.op}/sec." % [i.duration, iter / i.duration]
+        line << " %0.1f allocations/#{i.op}." % [i.allocs] unless i.allocs.nil?
+        puts line
       else
         puts "***** #{i.title}.#{i.op} failed! #{i.error}"
       end
@@ -74,6 +76,7 @@ class Perf
     attr_accessor :duration
     attr_accessor :rate
     attr_accessor :error
+    attr_accessor :allocs
 
     def initialize(title, op, &blk)
       @title = title
@@ -82,6 +85,7 @@ class Perf
       @duration = nil
       @rate = nil
       @error = nil
+      @allocs = nil
       @before = nil
     end
 
@@ -93,9 +97,11 @@ class Perf
       begin
         GC.start
         @before.call unless @before.nil?
+        objs = allocated_objects()
         start = Time.now
         iter.times { @blk.call }
         @duration = Time.now - start - base
+        @allocs = (allocated_objects() - objs).to_f / iter unless objs.nil?
         @duration = 0.0 if @duration < 0.0
         @rate = iter / @duration
       rescue Exception => e
@@ -103,5 +109,11 @@ class Perf
       end
     end
 
+    # Ruby objects allocated so far or nil if GC does not say.
+    def allocated_objects()
+      return nil unless GC.respond_to?(:stat)
+      GC.stat[:total_allocated_objects]
+    end
+
   end # Item
 end # Perf
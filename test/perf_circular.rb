@@ -0,0 +1,56 @@
+#!/usr/bin/env ruby -wW1
+
+$: << '.'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x,path = ARGV.slice!(i, 2)
+    $: << path
+  end
+end
+
+require 'optparse'
+require 'ox'
+require 'perf'
+
+# Dumps a large cyclic object graph with the :circular option. The nodes
+# form a binary tree where every node refers to its parent as well as its
+# children so each node is reached more than once but the recursion stays
+# shallow.
+
+class Node
+  def initialize(id, parent)
+    @id = id
+    @parent = parent
+    @kids = []
+  end
+  attr_reader :kids
+end
+
+$size = 100000
+$iter = 5
+do_load = false
+
+opts = OptionParser.new
+opts.on("-n", "--nodes [Int]", Integer, "number of nodes")    { |n| $size = n }
+opts.on("-i", "--iterations [Int]", Integer, "iterations")  { |i| $iter = i }
+opts.on("-l", "load as well as dump")                       { do_load = true }
+opts.on("-h", "--help", "Show this display")                { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+nodes = []
+$size.times do |i|
+  parent = (0 == i) ? nil : nodes[(i - 1) / 2]
+  nodes << Node.new(i, parent)
+  parent.kids << nodes[i] unless parent.nil?
+end
+$obj = nodes[0]
+$xml = Ox.dump($obj, :circular => true, :indent => 0)
+
+puts "#{$size} nodes, #{$xml.size} bytes of XML"
+perf = Perf.new()
+perf.add('Ox', 'dump') { Ox.dump($obj, :circular => true, :indent => 0) }
+perf.add('Ox', 'load') { Ox.load($xml, :mode => :object) } if do_load
+perf.run($iter)
@@ -23,6 +23,7 @@ $indent = 0
 
 do_sample = false
 do_files = false
+do_numbers = false
 
 do_load = false
 do_dump = false
@@ -35,6 +36,7 @@ opts.on("-c", "circular options")                           { $circular = true }
 
 opts.on("-s", "load and dump as sample Ruby object")        { do_sample = true }
 opts.on("-f", "load and dump as files Ruby object")         { do_files = true }
+opts.on("-n", "load and dump an Array of Floats")           { do_numbers = true }
 
 opts.on("-l", "load")                                       { do_load = true }
 opts.on("-d", "dump")                                       { do_dump = true }
@@ -47,6 +49,12 @@ opts.on("-i", "--iterations [Int]", Integer, "iterations")  { |i| $iter = i }
 opts.on("-h", "--help", "Show this display")                { puts opts; Process.exit!(0) }
 files = opts.parse(ARGV)
 
+# An Array of Floats with a spread of magnitudes and digit counts.
+def numbers_doc(size)
+  r = Random.new(1)
+  Array.new(size) { |i| (r.rand - 0.5) * 10.0 ** (i % 40 - 20) }
+end
+
 $obj = nil
 $xml = nil
 $mars = nil
@@ -61,7 +69,11 @@ end
 
 # prepare all the formats for input
 if files.empty?
-  $obj = do_sample ? sample_doc(2) : files('..')
+  if do_numbers
+    $obj = numbers_doc(10000)
+  else
+    $obj = do_sample ? sample_doc(2) : files('..')
+  end
   $mars = Marshal.dump($obj)
   $xml = Ox.dump($obj, :indent => $indent, circular: $circular)
   $json = Oj.dump($obj, :indent => $indent, circular: $circular)
@@ -96,6 +108,8 @@ if do_dump
   puts "Dump Performance"
   perf = Perf.new()
   perf.add('Ox', 'dump') { Ox.dump($obj, :indent => $indent, :circular => $circular) }
+  dumper = Ox::Dumper.new(:indent => $indent, :circular => $circular)
+  perf.add('Ox::Dumper', 'dump') { dumper.dump($obj) }
   perf.add('Oj', 'dump') { Oj.dump($obj) }
   perf.add('Marshal', 'dump') { Marshal.dump($obj) }
   perf.run($iter)
@@ -0,0 +1,81 @@
+#!/usr/bin/env ruby -wW1
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  while (i = ARGV.index('-I'))
+    x,path = ARGV.slice!(i, 2)
+    $: << path
+  end
+end
+
+require 'optparse'
+require 'ox'
+require 'perf'
+
+$filename = nil # nil indicates a new file named perf_parse.xml will be created and used
+$filesize = 10000 # KBytes
+$iter = 10
+$mode = :generic
+$ops = nil # nil runs all the operations
+
+opts = OptionParser.new
+opts.on("-f", "--file [String]", String, "filename")           { |f| $filename = f }
+opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |i| $iter = i }
+opts.on("-s", "--size [Int]", Integer, "file size in KBytes")  { |s| $filesize = s }
+opts.on("-l", "limited mode instead of generic")               { $mode = :limited }
+opts.on("-o", "--op [String]", String, "only run load or load_file") { |o| ($ops ||= []) << o }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+rest = opts.parse(ARGV)
+
+# size is in Kbytes
+def create_file(filename, size)
+  head = %{<?xml version="1.0"?>
+<table>
+}
+  tail = %{</table>
+}
+  row = %{  <row id="%08d" name="row %08d" class="even or odd">
+    <cell id="A" type="Fixnum">1234</cell>
+    <cell id="B" type="String">A string with an &amp; in it.</cell>
+    <cell id="C" type="String">This is a longer string that stretches over a larger number of characters and then goes on even further than that so it spans a few SIMD blocks.</cell>
+    <cell id="D" type="Float">-12.345</cell>
+    <cell id="E" type="Date">2011-09-18 23:07:26 +0900</cell>
+    <cell id="F" type="Image"><![CDATA[xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00xx00]]></cell>
+  </row>
+}
+  cnt = (size * 1000 - head.size - tail.size) / row.size
+  File.open(filename, "w") do |f|
+    f.write(head)
+    cnt.times do |i|
+      f.write(row % [i,i])
+    end
+    f.write(tail)
+  end
+end
+
+if $filename.nil?
+  create_file('perf_parse.xml', $filesize)
+  $filename = 'perf_parse.xml'
+end
+$xml_str = File.read($filename) if $ops.nil? || $ops.include?('load')
+
+puts "A #{File.size($filename) / 1000} KByte XML file was parsed #{$iter} times for this test."
+
+# Peak resident set size in KBytes or nil if it can not be determined.
+def peak_rss()
+  File.read('/proc/self/status')[/VmHWM:\s*(\d+)/, 1].to_i
+rescue Exception
+  nil
+end
+
+perf = Perf.new
+perf.add('Ox', 'load') { Ox.load($xml_str, :mode => $mode) } if $ops.nil? || $ops.include?('load')
+perf.add('Ox', 'load_file') { Ox.load_file($filename, :mode => $mode) } if $ops.nil? || $ops.include?('load_file')
+perf.run($iter)
+
+rss = peak_rss()
+puts "Peak RSS: #{rss / 1000} MBytes" unless rss.nil?
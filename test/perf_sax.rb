@@ -32,12 +32,20 @@ $filename = nil # nil indicates new file names perf.xml will be created and used
 $filesize = 1000 # KBytes
 $iter = 100
 $strio = false
+$str = false
+$wrap = false
+$gzip = false
+$batch = nil
 
 opts = OptionParser.new
 opts.on("-v", "increase verbosity")                            { $verbose += 1 }
 opts.on("-x", "ox only")                                       { $ox_only = true }
 opts.on("-a", "all callbacks")                                 { $all_cbs = true }
 opts.on("-z", "use StringIO instead of file")                  { $strio = true }
+opts.on("-t", "parse the String instead of a file")            { $str = true }
+opts.on("-w", "wrap the file in an IO without a fileno")       { $wrap = true }
+opts.on("-g", "read through a Zlib::GzipReader")               { $gzip = true }
+opts.on("-b", "--batch [Int]", Integer, "also time batched events") { |b| $batch = b }
 opts.on("-f", "--file [String]", String, "filename")           { |f| $filename = f }
 opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |i| $iter = i }
 opts.on("-s", "--size [Int]", Integer, "file size in KBytes")  { |s| $filesize = s }
@@ -92,6 +100,21 @@ class OxAllSax < OxSax
   def cdata(value); end
 end
 
+class OxBatchSax < OxSax
+  def start_element(name); end
+  def attr(name, str); end
+  def end_element(name); end
+  def text(str); end
+  def events(list); end
+end
+
+class OxAllBatchSax < OxBatchSax
+  def instruct(target); end
+  def doctype(value); end
+  def comment(value); end
+  def cdata(value); end
+end
+
 unless defined?(::Nokogiri).nil?
   class NoSax < Nokogiri::XML::SAX::Document
     def error(message); puts message; end
@@ -139,6 +162,41 @@ if $filename.nil?
   $filename = 'perf.xml'
 end
 $xml_str = File.read($filename)
+if $gzip
+  require 'zlib'
+  Zlib::GzipWriter.open($filename + '.gz') { |gz| gz.write($xml_str) }
+end
+
+# Ox reads from an IO with a fileno directly so wrap it to go through Ruby.
+class NoFileno
+  def initialize(io)
+    @io = io
+  end
+  def readpartial(max, outbuf=nil)
+    outbuf.nil? ? @io.readpartial(max) : @io.readpartial(max, outbuf)
+  end
+  def close()
+    @io.close
+  end
+end
+
+def open_input()
+  if $str
+    return $xml_str
+  elsif $strio
+    input = StringIO.new($xml_str)
+  elsif $gzip
+    input = Zlib::GzipReader.open($filename + '.gz')
+  else
+    input = IO.open(IO.sysopen($filename))
+  end
+  input = NoFileno.new(input) if $wrap
+  input
+end
+
+def close_input(input)
+  input.close unless input.is_a?(String)
+end
 
 puts "A #{$filesize} KByte XML file was parsed #{$iter} times for this test."
 
@@ -146,29 +204,46 @@ $handler = nil
 perf = Perf.new
 
 perf.add('Ox::Sax', 'sax_parse') {
-  input = $strio ? StringIO.new($xml_str) : IO.open(IO.sysopen($filename))
+  input = open_input()
   Ox.sax_parse($handler, input)
-  input.close
+  close_input(input)
 }
 perf.before('Ox::Sax') { $handler = $all_cbs ? OxAllSax.new() : OxSax.new() }
 
+unless $batch.nil?
+  # the per event handler has the same callbacks as the batched one
+  perf.add('Ox::Sax events', 'sax_parse') {
+    input = open_input()
+    Ox.sax_parse($handler, input)
+    close_input(input)
+  }
+  perf.before('Ox::Sax events') { $handler = $all_cbs ? OxAllBatchSax.new() : OxBatchSax.new() }
+
+  perf.add('Ox::Sax batch', 'sax_parse') {
+    input = open_input()
+    Ox.sax_parse($handler, input, :batch => $batch)
+    close_input(input)
+  }
+  perf.before('Ox::Sax batch') { $handler = $all_cbs ? OxAllBatchSax.new() : OxBatchSax.new() }
+end
+
 unless $ox_only
   unless defined?(::Nokogiri).nil?
     perf.add('Nokogiri::XML::Sax', 'parse') {
-      input = $strio ? StringIO.new($xml_str) : IO.open(IO.sysopen($filename))
+      input = open_input()
       $handler.parse(input)
-      input.close
+      close_input(input)
     }
     perf.before('Nokogiri::XML::Sax') { $handler = Nokogiri::XML::SAX::Parser.new($all_cbs ? NoAllSax.new() : NoSax.new()) }
   end
 
   unless defined?(::LibXML).nil?
     perf.add('LibXML::XML::Sax', 'parse') {
-      input = $strio ? StringIO.new($xml_str) : IO.open(IO.sysopen($filename))
+      input = open_input()
       parser = LibXML::XML::SaxParser.io(input)
       parser.callbacks = $handler
       parser.parse()
-      input.close
+      close_input(input)
     }
     perf.before('LibXML::XML::Sax') { $handler = $all_cbs ? LxAllSax.new() : LxSax.new() }
   end
@@ -63,6 +63,47 @@ class AllSax < StartSax
   end
 end
 
+class BatchSax < AllSax
+  attr_accessor :batches
+
+  def initialize()
+    super
+    @batches = 0
+  end
+
+  def events(list)
+    @batches += 1
+    list.each_slice(3) { |e| @calls << e.compact }
+  end
+end
+
+class AttrsSax < AllSax
+  def start_element(name, attrs)
+    @calls << [:start_element, name, attrs]
+  end
+end
+
+class SkipSax < AllSax
+  def start_element(name)
+    super
+    skip! if :skip == name
+  end
+end
+
+class SkipAttrsSax < AllSax
+  def start_element(name, attrs)
+    @calls << [:start_element, name, attrs]
+    skip! if :skip == name
+  end
+end
+
+class TextSkipSax < AllSax
+  def text(value)
+    super
+    skip!
+  end
+end
+
 class TypeSax < ::Ox::Sax
   attr_accessor :item
   # method to call on the Ox::Sax::Value Object
@@ -82,6 +123,42 @@ class TypeSax < ::Ox::Sax
   end
 end
 
+# Hands each value to a block.
+class BlockSax < ::Ox::Sax
+  def initialize(&blk)
+    @blk = blk
+  end
+
+  def attr_value(name, value)
+    @blk.call(value)
+  end
+
+  def value(value)
+    @blk.call(value)
+  end
+end
+
+# An input with only readpartial() that remembers how much was asked for.
+class PartialReader
+  attr_reader :maxes
+
+  # A chunk size returns that many bytes no matter how many are asked for.
+  def initialize(str, chunk=nil)
+    @str = str
+    @chunk = chunk
+    @pos = 0
+    @maxes = []
+  end
+
+  def readpartial(max)
+    @maxes << max
+    raise EOFError if @str.size <= @pos
+    s = @str[@pos, @chunk || max]
+    @pos += s.size
+    s
+  end
+end
+
 class Func < ::Test::Unit::TestCase
 
   def test_sax_io_pipe
@@ -102,6 +179,25 @@ class Func < ::Test::Unit::TestCase
                   [:end_element, :top]], handler.calls)
   end
 
+  # Large files are mapped instead of read, from wherever the file is.
+  def test_sax_io_large_file
+    head = 'skipped ' * 1000
+    xml = %{<top>\n#{%{  <child a="1">abc &amp; def</child>\n} * 3000}</top>\n}
+    filename = 'sax_large_file_test.xml'
+    File.open(filename, 'w') { |f| f.write(head + xml) }
+    handler = AllSax.new()
+    input = IO.open(IO.sysopen(filename))
+    input.sysread(head.size)
+    Ox.sax_parse(handler, input, :convert_special => true)
+    input.close
+    assert_equal(3000 * 4 + 2, handler.calls.size)
+    assert_equal([:start_element, :top], handler.calls[0])
+    assert_equal([:text, "abc & def"], handler.calls[-3])
+    assert_equal([:end_element, :top], handler.calls[-1])
+  ensure
+    File.delete(filename) if File.exist?(filename)
+  end
+
   def parse_compare(xml, expected, handler_class=AllSax, special=false)
     handler = handler_class.new()
     input = StringIO.new(xml)
@@ -156,7 +252,7 @@ encoding = "UTF-8" ?>},
     parse_compare(%{<top/><top/>},
                   [[:start_element, :top],
                    [:end_element, :top],
-                   [:error, "invalid format, multiple top level elements", 1, 9],
+                   [:error, "invalid format, multiple top level elements", 1, 7],
                    [:start_element, :top],
                    [:end_element, :top]])
 
@@ -208,7 +304,7 @@ encoding = "UTF-8" ?>},
                    [:start_element, :child],
                    [:start_element, :grandchild],
                    [:end_element, :grandchild],
-                   [:error, "invalid format, element start and end names do not match", 5, 12]
+                   [:error, "invalid format, element start and end names do not match", 5, 11]
                   ])
   end
 
@@ -248,7 +344,7 @@ encoding = "UTF-8" ?>},
                   [[:start_element, :top],
                    [:start_element, :child],
                    [:end_element, :child],
-                   [:error, "invalid format, element not terminated", 4, 1]
+                   [:error, "invalid format, element not terminated", 4, 0]
                   ])
   end
 
@@ -272,7 +368,16 @@ encoding = "UTF-8" ?>},
   def test_sax_text_no_term
     parse_compare(%{<top>This is some text.},
                   [[:start_element, :top],
-                   [:error, "invalid format, text terminated unexpectedly", 1, 24],
+                   [:error, "invalid format, text terminated unexpectedly", 1, 23],
+                  ])
+  end
+
+  # columns count from the start of the line the same way on every line
+  def test_sax_text_no_term_line2
+    parse_compare(%{
+<top>This is some text.},
+                  [[:start_element, :top],
+                   [:error, "invalid format, text terminated unexpectedly", 2, 23],
                   ])
   end
   # TBD invalid chacters in text
@@ -298,7 +403,7 @@ encoding = "UTF-8" ?>},
                    [:attr, :version, "1.0"],
                    [:start_element, :top],
                    [:end_element, :top],
-                   [:error, "invalid format, DOCTYPE can not come after an element", 3, 11],
+                   [:error, "invalid format, DOCTYPE can not come after an element", 3, 10],
                    [:doctype, ' top PUBLIC "top.dtd"']])
   end
   
@@ -309,7 +414,7 @@ encoding = "UTF-8" ?>},
 <top/>
 },
                   [[:doctype, " top PUBLIC \"top.dtd\""],
-                   [:error, "invalid format, instruction must come before elements", 3, 3],
+                   [:error, "invalid format, instruction must come before elements", 3, 2],
                    [:instruct, "xml"],
                    [:attr, :version, "1.0"],
                    [:start_element, :top],
@@ -338,7 +443,7 @@ encoding = "UTF-8" ?>},
 },
                   [[:instruct, 'xml'],
                    [:attr, :version, "1.0"],
-                   [:error, "invalid format, comment terminated unexpectedly", 3, 1], # continue on
+                   [:error, "invalid format, comment terminated unexpectedly", 3, 0], # continue on
                    [:comment, 'First comment.'],
                    [:start_element, :top],
                    [:end_element, :top]])
@@ -366,7 +471,7 @@ encoding = "UTF-8" ?>},
                   [[:instruct, 'xml'],
                    [:attr, :version, "1.0"],
                    [:start_element, :top],
-                   [:error, "invalid format, cdata terminated unexpectedly", 5, 1]])
+                   [:error, "invalid format, cdata terminated unexpectedly", 5, 0]])
   end
   
   def test_sax_cdata_empty
@@ -498,6 +603,10 @@ encoding = "UTF-8" ?>},
     handler = TypeSax.new(:as_f)
     Ox.sax_parse(handler, StringIO.new(%{<top>7</top>}))
     assert_equal(7.0, handler.item)
+    Ox.sax_parse(handler, StringIO.new(%{<top>-1.25e-3</top>}))
+    assert_equal(-0.00125, handler.item)
+    Ox.sax_parse(handler, StringIO.new(%{<top>12345678901234567890123.e5</top>}))
+    assert_equal(1.2345678901234569e+27, handler.item)
   end
 
   def test_sax_value_sym
@@ -530,6 +639,58 @@ encoding = "UTF-8" ?>},
     assert_equal(t.usec, handler.item.usec)
   end
 
+  def test_sax_value_compare
+    results = []
+    handler = BlockSax.new { |v|
+      results << [v == 'a < b', v == :'a < b', v == 'a', v == 7, v.start_with?('a <'), v.start_with?(:b)]
+    }
+    Ox.sax_parse(handler, StringIO.new(%{<top x="a &lt; b">a &lt; b</top>}), :convert_special => true)
+    assert_equal([[true, true, false, false, true, false]] * 2, results)
+    results = []
+    Ox.sax_parse(handler, %{<top>a &lt; b</top>})
+    assert_equal([[false, false, false, false, false, false]], results)
+  end
+
+  def test_sax_value_repeat
+    results = []
+    handler = BlockSax.new { |v| results << v.as_time << v.as_time << v.as_s << v.as_s }
+    Ox.sax_parse(handler, StringIO.new(%{<top>2012-01-05T10:20:30.000</top>}))
+    # each call makes a new object so changing one does not change the next
+    assert_equal(results[0], results[1])
+    assert(!results[0].equal?(results[1]))
+    assert_equal(results[2], results[3])
+    assert(!results[2].equal?(results[3]))
+    results = []
+    handler = BlockSax.new { |v| results << v.as_i << v.as_f }
+    Ox.sax_parse(handler, StringIO.new(%{<top a="12345678901234567890">-3</top>}))
+    assert_equal([12345678901234567890, 12345678901234567890.0, -3, -3.0], results)
+    # conversions all see the text with special characters converted
+    results = []
+    handler = BlockSax.new { |v| results << v.as_sym << v.as_s << v.as_sym << v.as_i }
+    Ox.sax_parse(handler, StringIO.new(%{<top>&#49;2</top>}), :convert_special => true)
+    assert_equal([:'12', '12', :'12', 12], results)
+  end
+
+  def test_sax_value_bad_fixnum
+    ['12x', '1234567890123456789012x', '-', '+', '-x'].each do |str|
+      handler = BlockSax.new { |v| v.as_i }
+      assert_raise(ArgumentError) { Ox.sax_parse(handler, StringIO.new(%{<top>#{str}</top>})) }
+    end
+  end
+
+  def test_sax_value_time_zones
+    handler = TypeSax.new(:as_time)
+    [['2012-01-05T10:20:30.123456789-05:30', Time.utc(2012, 1, 5, 15, 50, 30, Rational(123456789, 1000))],
+     ['2012-01-05T10:20:30Z', Time.utc(2012, 1, 5, 10, 20, 30)],
+     ['2012-07-05T10:20:30', Time.local(2012, 7, 5, 10, 20, 30)],
+     ['2012-02-29', Time.local(2012, 2, 29)],
+     ['1969-12-31T23:59:59+00:00', Time.utc(1969, 12, 31, 23, 59, 59)]].each do |text,t|
+      Ox.sax_parse(handler, StringIO.new(%{<top>#{text}</top>}))
+      assert_equal(t, handler.item, text)
+      assert_equal(t.nsec, handler.item.nsec, text)
+    end
+  end
+
   def test_sax_attr_value_fixnum
     handler = TypeSax.new(nil)
     Ox.sax_parse(handler, StringIO.new(%{<top as_i="7"/>}))
@@ -578,4 +739,314 @@ encoding = "UTF-8" ?>},
     assert_equal(t.usec, handler.item.usec)
   end
 
+  def test_sax_start_element_attrs
+    parse_compare(%{<?xml version="1.0"?>
+<top>
+  <child first="one" second='two &amp; more'>text</child>
+  <empty/>
+</top>
+},
+                  [[:instruct, 'xml'],
+                   [:attr, :version, "1.0"],
+                   [:start_element, :top, {}],
+                   [:start_element, :child, {:first => 'one', :second => 'two & more'}],
+                   [:text, 'text'],
+                   [:end_element, :child],
+                   [:start_element, :empty, {}],
+                   [:end_element, :empty],
+                   [:end_element, :top]], AttrsSax)
+  end
+
+  def test_sax_filter
+    xml = %{<?xml version="1.0"?>
+<!-- top comment -->
+<table>
+  <head title="a > b"><cell>head</cell><row><cell>not me</cell></row></head>
+  <row id="1">
+    <cell id="A">one</cell>
+    <skip><!-- <cell> --><![CDATA[</skip>]]><skip a='/>'/><?pi <cell>?></skip>
+    <cell id="B"><b>two</b></cell>
+  </row>
+  <row id="2"><cell/></row>
+</table>
+}
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(xml), :filter => '/table/row/cell')
+    assert_equal([[:start_element, :cell],
+                  [:attr, :id, 'A'],
+                  [:text, 'one'],
+                  [:end_element, :cell],
+                  [:start_element, :cell],
+                  [:attr, :id, 'B'],
+                  [:start_element, :b],
+                  [:text, 'two'],
+                  [:end_element, :b],
+                  [:end_element, :cell],
+                  [:start_element, :cell],
+                  [:end_element, :cell]], handler.calls)
+
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(xml), :filter => ['/table/*/cell', '/table/row/cell/b'])
+    assert_equal([[:start_element, :cell],
+                  [:text, 'head'],
+                  [:end_element, :cell],
+                  [:start_element, :cell],
+                  [:attr, :id, 'A'],
+                  [:text, 'one'],
+                  [:end_element, :cell],
+                  [:start_element, :cell],
+                  [:attr, :id, 'B'],
+                  [:start_element, :b],
+                  [:text, 'two'],
+                  [:end_element, :b],
+                  [:end_element, :cell],
+                  [:start_element, :cell],
+                  [:end_element, :cell]], handler.calls)
+  end
+
+  def test_sax_filter_not_terminated
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(%{<top><skip><a></a>}), :filter => '/top/keep')
+    assert_equal([[:error, "invalid format, element not terminated", 1, 18]], handler.calls)
+  end
+
+  def test_sax_filter_bad_path
+    assert_raise(ArgumentError) { Ox.sax_parse(AllSax.new(), StringIO.new(%{<top/>}), :filter => '/top//a') }
+    assert_raise(ArgumentError) { Ox.sax_parse(AllSax.new(), StringIO.new(%{<top/>}), :filter => 7) }
+  end
+
+  def test_sax_skip
+    xml = %{<top>
+  <skip id="1" title="<a>"><a><b>text</b></a><!-- </skip> --><![CDATA[</skip>]]><c x='>'/></skip>
+  <keep>text</keep>
+  <skip/>
+</top>
+}
+    parse_compare(xml, [[:start_element, :top],
+                        [:start_element, :skip],
+                        [:end_element, :skip],
+                        [:start_element, :keep],
+                        [:text, 'text'],
+                        [:end_element, :keep],
+                        [:start_element, :skip],
+                        [:end_element, :skip],
+                        [:end_element, :top]], SkipSax)
+    parse_compare(xml, [[:start_element, :top, {}],
+                        [:start_element, :skip, {:id => '1', :title => '<a>'}],
+                        [:end_element, :skip],
+                        [:start_element, :keep, {}],
+                        [:text, 'text'],
+                        [:end_element, :keep],
+                        [:start_element, :skip, {}],
+                        [:end_element, :skip],
+                        [:end_element, :top]], SkipAttrsSax)
+  end
+
+  def test_sax_skip_outside_start_element
+    parse_compare(%{<top>hi<a><b/></a><c/></top>},
+                  [[:start_element, :top],
+                   [:text, 'hi'],
+                   [:start_element, :a],
+                   [:start_element, :b],
+                   [:end_element, :b],
+                   [:end_element, :a],
+                   [:start_element, :c],
+                   [:end_element, :c],
+                   [:end_element, :top]], TextSkipSax)
+  end
+
+  def test_sax_batch
+    xml = %{<?xml version="1.0"?>
+<!DOCTYPE top PUBLIC "-//ox//DTD TABLE 1.0//EN">
+<top>
+  <child name="first">Some text.</child>
+  <child name="second"><![CDATA[data]]></child>
+  <!-- a comment -->
+</top>
+}
+    expected = AllSax.new()
+    Ox.sax_parse(expected, StringIO.new(xml))
+    [1, 4, 1000].each do |n|
+      handler = BatchSax.new()
+      Ox.sax_parse(handler, StringIO.new(xml), :batch => n)
+      assert_equal(expected.calls, handler.calls)
+      assert_equal((expected.calls.size + n - 1) / n, handler.batches)
+    end
+  end
+
+  def test_sax_batch_error
+    handler = BatchSax.new()
+    Ox.sax_parse(handler, StringIO.new(%{<top>text<top2></top2>}), :batch => 100)
+    assert_equal([[:start_element, :top],
+                  [:text, 'text'],
+                  [:start_element, :top2],
+                  [:end_element, :top2],
+                  [:error, "invalid format, element not terminated", 1, 22]], handler.calls)
+  end
+
+  def test_sax_batch_needs_events
+    assert_raise(ArgumentError) { Ox.sax_parse(AllSax.new(), StringIO.new(%{<top/>}), :batch => 10) }
+  end
+
+  def test_sax_pusher
+    xml = %{<?xml version="1.0"?>
+<top>
+  <child name="first">Some text.</child>
+  <child name="second"><![CDATA[data]]></child>
+  <!-- a comment -->
+</top>
+}
+    expected = AllSax.new()
+    Ox.sax_parse(expected, StringIO.new(xml))
+    # split everywhere so every token gets cut at a chunk boundary
+    [1, 2, 3, 7, xml.size].each do |n|
+      handler = AllSax.new()
+      pusher = Ox::Sax::Pusher.new(handler)
+      0.step(xml.size - 1, n) { |i| pusher.feed(xml[i, n]) }
+      pusher.finish()
+      assert_equal(expected.calls, handler.calls)
+    end
+  end
+
+  def test_sax_pusher_events_as_fed
+    handler = AllSax.new()
+    pusher = Ox::Sax::Pusher.new(handler)
+    pusher.feed(%{<top><chi})
+    assert_equal([[:start_element, :top]], handler.calls)
+    pusher.feed(%{ld/>})
+    assert_equal([[:start_element, :top],
+                  [:start_element, :child],
+                  [:end_element, :child]], handler.calls)
+    pusher.feed(%{</top>})
+    pusher.finish()
+    assert_equal([[:start_element, :top],
+                  [:start_element, :child],
+                  [:end_element, :child],
+                  [:end_element, :top]], handler.calls)
+  end
+
+  def test_sax_pusher_not_terminated
+    handler = StartSax.new()
+    pusher = Ox::Sax::Pusher.new(handler)
+    pusher.feed(%{<top><child>})
+    assert_raise(SyntaxError) { pusher.finish() }
+  end
+
+  # A Pusher dropped before the document ends takes its parser state with it.
+  def test_sax_pusher_dropped
+    200.times { Ox::Sax::Pusher.new(AllSax.new()).feed(%{<top><a>some text}) }
+    GC.start
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(%{<top>done</top>}))
+    assert_equal([[:start_element, :top],
+                  [:text, 'done'],
+                  [:end_element, :top]], handler.calls)
+  end
+
+  def test_sax_pusher_readpartial_outbuf
+    pusher = Ox::Sax::Pusher.new(StartSax.new())
+    pusher.instance_variable_set(:@chunk, 'abcdef')
+    buf = ''
+    assert(buf.equal?(pusher.readpartial(4, buf)))
+    assert_equal('abcd', buf)
+    assert_equal('ef', pusher.readpartial(4))
+  end
+
+  def test_sax_buffer_size
+    long = 'x' * 1000
+    handler = AllSax.new()
+    input = PartialReader.new(%{<top><a>#{long}</a><b name="#{long}"/><c>short</c></top>})
+    Ox.sax_parse(handler, input, :buffer_size => 16, :buffer_growth => 1.5)
+    assert_equal([[:start_element, :top],
+                  [:start_element, :a],
+                  [:text, long],
+                  [:end_element, :a],
+                  [:start_element, :b],
+                  [:attr, :name, long],
+                  [:end_element, :b],
+                  [:start_element, :c],
+                  [:text, 'short'],
+                  [:end_element, :c],
+                  [:end_element, :top]], handler.calls)
+    # reads ask for no more than fits so they show the buffer size
+    assert_equal(16, input.maxes[0])
+    assert(input.maxes.include?(12) && input.maxes.include?(18) && input.maxes.include?(27))
+    assert(input.maxes.max < 1100)
+  end
+
+  def test_sax_max_buffer_size
+    handler = AllSax.new()
+    input = PartialReader.new(%{<top><a>#{'x' * 50}</a><b>#{'x' * 100}</b></top>})
+    assert_raise(IOError) { Ox.sax_parse(handler, input, :buffer_size => 16, :max_buffer_size => 64) }
+    assert_equal([:text, 'x' * 50], handler.calls[2])
+    assert(input.maxes.max <= 64)
+    assert_raise(ArgumentError) { Ox.sax_parse(handler, StringIO.new(%{<top/>}), :buffer_size => 8) }
+    assert_raise(ArgumentError) { Ox.sax_parse(handler, StringIO.new(%{<top/>}), :buffer_growth => 1) }
+    assert_raise(ArgumentError) { Ox.sax_parse(handler, StringIO.new(%{<top/>}), :buffer_size => 64, :max_buffer_size => 32) }
+  end
+
+  def test_sax_oversized_read
+    xml = %{<top><a>#{'x' * 50}</a><b>#{'y' * 100}</b></top>}
+    handler = AllSax.new()
+    Ox.sax_parse(handler, PartialReader.new(xml, 100), :buffer_size => 16)
+    assert_equal([[:start_element, :top],
+                  [:start_element, :a],
+                  [:text, 'x' * 50],
+                  [:end_element, :a],
+                  [:start_element, :b],
+                  [:text, 'y' * 100],
+                  [:end_element, :b],
+                  [:end_element, :top]], handler.calls)
+    assert_raise(IOError) { Ox.sax_parse(AllSax.new(), PartialReader.new(xml, 100), :buffer_size => 16, :max_buffer_size => 64) }
+  end
+
+  def test_sax_string
+    xml = %{<?xml version="1.0"?>
+<!DOCTYPE top PUBLIC "top.dtd">
+<top a="1 &lt; 2">
+  <!-- note -->
+  <child><![CDATA[<raw>]]></child>
+  text &amp; more
+</top>
+}
+    orig = xml.dup
+    handler = AllSax.new()
+    Ox.sax_parse(handler, xml, :convert_special => true)
+    assert_equal([[:instruct, 'xml'],
+                  [:attr, :version, '1.0'],
+                  [:doctype, ' top PUBLIC "top.dtd"'],
+                  [:start_element, :top],
+                  [:attr, :a, '1 < 2'],
+                  [:comment, ' note '],
+                  [:start_element, :child],
+                  [:cdata, '<raw>'],
+                  [:end_element, :child],
+                  [:text, "text & more\n"],
+                  [:end_element, :top]], handler.calls)
+    assert_equal(orig, xml)
+  end
+
+  def test_sax_string_values
+    [[:as_i, '-7', -7],
+     [:as_f, '7.5', 7.5],
+     [:as_s, 'a &amp; b', 'a & b'],
+     [:as_sym, 'abc', :abc],
+     [:as_bool, 'true', true]].each do |type,text,expected|
+      handler = TypeSax.new(type)
+      Ox.sax_parse(handler, %{<top>#{text}</top>}, :convert_special => true)
+      assert_equal(expected, handler.item)
+    end
+    handler = TypeSax.new(:as_s)
+    Ox.sax_parse(handler, %{<top as_i="12"/>})
+    assert_equal(12, handler.item)
+  end
+
+  def test_sax_string_not_terminated
+    handler = AllSax.new()
+    Ox.sax_parse(handler, %{<top><child>text})
+    assert_equal([[:start_element, :top],
+                  [:start_element, :child],
+                  [:error, "invalid format, text terminated unexpectedly", 1, 16]], handler.calls)
+  end
+
 end
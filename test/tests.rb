@@ -34,6 +34,7 @@ class Func < ::Test::Unit::TestCase
                    :xsd_date=>false,
                    :mode=>nil,
                    :symbolize_keys=>true,
+                   :typed_text=>false,
                    :effort=>:strict})
   end
 
@@ -49,6 +50,7 @@ class Func < ::Test::Unit::TestCase
       :xsd_date=>false,
       :mode=>nil,
       :symbolize_keys=>true,
+      :typed_text=>false,
       :effort=>:strict}
     o2 = {
       :encoding=>"UTF-8",
@@ -61,6 +63,7 @@ class Func < ::Test::Unit::TestCase
       :xsd_date=>true,
       :mode=>:object,
       :symbolize_keys=>true,
+      :typed_text=>true,
       :effort=>:tolerant }
     o3 = { :xsd_date=>false }
     Ox.default_options = o2
@@ -94,6 +97,36 @@ class Func < ::Test::Unit::TestCase
     dump_and_load(0.0, false)
     dump_and_load(-10.000005, false)
     dump_and_load(1.000000000005, false)
+    dump_and_load(0.1 + 0.2, false)
+    dump_and_load(1.0e23, false)
+    dump_and_load(-2.2250738585072014e-308, false)
+    dump_and_load(5.0e-324, false)
+    dump_and_load(1.7976931348623157e308, false)
+    dump_and_load(1.0 / 0.0, false)
+  end
+
+  def test_float_text
+    assert_equal(%{<f>0.1</f>\n}, Ox.dump(0.1))
+    assert_equal(%{<f>-123.5</f>\n}, Ox.dump(-123.5))
+    assert_equal(%{<f>1.5e-07</f>\n}, Ox.dump(1.5e-7))
+    assert_equal(%{<f>1e+16</f>\n}, Ox.dump(1.0e16))
+    assert_equal(%{<f>1e+23</f>\n}, Ox.dump(1.0e23))
+    ['12345678901234567890123e-3', '0.000000000000000000000000000012', '1e-400', '.5', '7'].each do |t|
+      assert_equal(t.to_f, Ox.load(%{<f>#{t}</f>}, :mode => :object), t)
+    end
+    # read the way strtod() reads them, not as Ruby literals
+    { '-6.e-324' => -5.0e-324,
+      '5.e-330' => 0.0,
+      '12345678901234567890123.e5' => 1.2345678901234569e+27,
+      '4722294835683761312934247.e320' => 1.0 / 0.0,
+      '1e400' => 1.0 / 0.0,
+      '1.e5' => 100000.0,
+      '0x1A' => 26.0,
+      '-0x1.8p1' => -3.0,
+      '0x1.000000000000081p0' => 1.0000000000000002,
+    }.each do |t,f|
+      assert_equal(f, Ox.load(%{<f>#{t}</f>}, :mode => :object), t)
+    end
   end
 
   def test_string
@@ -114,6 +147,14 @@ class Func < ::Test::Unit::TestCase
     dump_and_load(Time.now, false)
   end
 
+  def test_time_xsd
+    t = Time.now
+    loaded = Ox.load(Ox.dump(t, :xsd_date => true), :mode => :object)
+    assert_equal(t.to_i, loaded.to_i)
+    assert_equal(t.usec, loaded.usec)
+    assert_equal(t.utc_offset, loaded.utc_offset)
+  end
+
   def test_date
     dump_and_load(Date.new(2011, 1, 5), false)
   end
@@ -266,6 +307,37 @@ class Func < ::Test::Unit::TestCase
     assert_equal(xml, dumped_xml)
   end
 
+  def test_escape_long_value
+    # special characters on both sides of the 16 and 32 byte block edges
+    [0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 70].each do |pos|
+      str = 'x' * pos + %{<&>"'\t} + 'y' * (70 - pos)
+      top = Ox::Element.new('top')
+      top << str
+      xml = Ox.dump(top)
+      assert_equal(%{\n<top>#{'x' * pos}&lt;&amp;&gt;&quot;&apos;\t#{'y' * (70 - pos)}</top>\n}, xml)
+      dump_and_load(str, false)
+    end
+  end
+
+  def test_frozen_string_repeats
+    clean = ('clean text ' * 40).freeze
+    dirty = ('a < b & c ' * 40).freeze
+    obj = [clean, dirty] * 3 + [{ clean => dirty, dirty => clean }]
+    xml = Ox.dump(obj)
+    assert_equal(Ox.dump(obj.map { |x| x.is_a?(String) ? x.dup : x }), xml)
+    assert_equal(5, xml.scan(dirty.gsub('&', '&amp;').gsub('<', '&lt;')).size)
+    assert_equal(obj, Ox.load(xml, :mode => :object))
+  end
+
+  def test_special_chars
+    doc = Ox.parse(%{<top name="&#x41;&#66;&unknown;z">x &unknown y &#x41;&#66; "\0"</top>})
+    assert_equal('AB&unknown;z', doc.attributes[:name])
+    assert_equal(%{x &unknown y AB "\0"}, doc.nodes[0])
+    doc = Ox.parse(%{<top name="a &unknown b &lt;&amp c">a &unknown b &lt;&amp c</top>})
+    assert_equal('a &unknown b <&amp c', doc.attributes[:name])
+    assert_equal('a &unknown b <&amp c', doc.nodes[0])
+  end
+
   def test_attr_as_string
     xml = %{<top name="Pete"/>}
     doc = Ox.load(xml, :mode => :generic, :symbolize_keys => false)
@@ -499,6 +571,137 @@ class Func < ::Test::Unit::TestCase
     assert_equal(xml, xml2)
   end
 
+  def test_generic_long_text
+    text = 'abc &amp; &lt;def&gt; ' * 1000
+    xml = %{<?xml?>
+<Top>
+  <Str>#{text}</Str>
+  <Str>#{'x' * 5000}</Str>
+</Top>
+}
+    doc = Ox.load(xml, :mode => :generic)
+    assert_equal('abc & <def> ' * 1000, doc.nodes[0].nodes[0].nodes[0])
+    assert_equal('x' * 5000, doc.nodes[0].nodes[1].nodes[0])
+    xml2 = Ox.dump(doc, :with_xml => true)
+    assert_equal(xml, xml2)
+  end
+
+  def test_load_frozen
+    xml = %{<?xml?>\n<Top>\n#{"  <Str a=\"1 &lt; 2\">abc &amp; def</Str>\n" * 3000}</Top>\n}.freeze
+    orig = xml.dup
+    doc = Ox.load(xml, :mode => :generic)
+    assert_equal(orig, xml)
+    assert_equal(3000, doc.nodes[0].nodes.size)
+    assert_equal('abc & def', doc.nodes[0].nodes[-1].nodes[0])
+    assert_equal('1 < 2', doc.nodes[0].nodes[-1].attributes.values[0])
+  end
+
+  def test_cache_limit
+    limit = Ox.cache_limit
+    Ox.cache_limit = 50
+    before = Ox.cache_stats[:symbol]
+    200.times { |i| Ox.load(%{<top cache_limit_#{i}="#{i}"/>}, :mode => :generic) }
+    stats = Ox.cache_stats[:symbol]
+    assert_equal(50, stats[:limit])
+    assert(stats[:size] <= 50)
+    assert(150 <= stats[:evictions] - before[:evictions])
+    assert(200 <= stats[:misses] - before[:misses])
+    doc = Ox.load(%{<top cache_limit_7="7"/>}, :mode => :generic)
+    assert_equal({ :cache_limit_7 => '7' }, doc.attributes)
+    Ox.clear_caches
+    assert_equal(0, Ox.cache_stats[:symbol][:size])
+    doc = Ox.load(%{<top cache_limit_7="7"/>}, :mode => :generic)
+    assert_equal({ :cache_limit_7 => '7' }, doc.attributes)
+  ensure
+    Ox.cache_limit = limit
+  end
+
+  def test_typed_text
+    xml = %{<top><a>2012-01-05T10:20:30.25+09:00</a><b>2012-01-05T10:20:30Z</b><c>2012-01-05 10:20</c><d>2012-01-05T10:20:30 later</d></top>}
+    doc = Ox.load(xml, :mode => :generic, :typed_text => true)
+    a, b, c, d = doc.nodes.map { |n| n.nodes[0] }
+    assert_equal(Time.utc(2012, 1, 5, 1, 20, 30.25), a)
+    assert_equal(9 * 3600, a.utc_offset)
+    assert_equal(Time.utc(2012, 1, 5, 10, 20, 30), b)
+    assert(b.utc?)
+    assert_equal(Time.local(2012, 1, 5, 10, 20), c)
+    assert_equal('2012-01-05T10:20:30 later', d)
+    doc = Ox.load(xml, :mode => :generic)
+    assert_equal('2012-01-05T10:20:30Z', doc.nodes[1].nodes[0])
+    # days past the end of the month are not dates
+    ['2012-02-30T10:20:30Z', '2011-02-29T10:20:30Z', '2012-04-31', '2012-01-00'].each do |str|
+      doc = Ox.load(%{<top>#{str}</top>}, :mode => :generic, :typed_text => true)
+      assert_equal(str, doc.nodes[0], str)
+    end
+    doc = Ox.load(%{<top>2000-02-29</top>}, :mode => :generic, :typed_text => true)
+    assert_equal(Time.local(2000, 2, 29), doc.nodes[0])
+  end
+
+  def test_load_file
+    xml = %{<?xml?>\n<Top>\n#{"  <Str a=\"1\">abc &amp; def</Str>\n" * 3000}</Top>\n}
+    filename = 'load_file_test.xml'
+    [xml, xml[0..-2] + ' ' * (4096 - xml.size % 4096) + "\n"].each do |content|
+      File.open(filename, 'w') { |f| f.write(content) }
+      doc = Ox.load_file(filename, :mode => :generic)
+      assert_equal(3000, doc.nodes[0].nodes.size)
+      assert_equal('abc & def', doc.nodes[0].nodes[-1].nodes[0])
+    end
+  ensure
+    File.delete(filename) if File.exist?(filename)
+  end
+
+  class ChunkWriter
+    attr_reader :chunks
+    def initialize()
+      @chunks = []
+    end
+    def write(str)
+      @chunks << str
+      str.size
+    end
+  end
+
+  def test_dump_io
+    obj = (1..20000).map { |i| ["item #{i} & more", i, i * 0.5] }
+    xml = Ox.dump(obj, :indent => 1, :with_instruct => true)
+    w = ChunkWriter.new()
+    assert_equal(nil, Ox.dump(obj, w, :indent => 1, :with_instruct => true))
+    assert(2 < w.chunks.size)
+    assert_equal(xml, w.chunks.join(''))
+    doc = Ox.load(xml, :mode => :generic)
+    w = ChunkWriter.new()
+    Ox.dump(doc, w)
+    assert_equal(Ox.dump(doc), w.chunks.join(''))
+    assert_raise(ArgumentError) { Ox.dump(obj, 7) }
+  end
+
+  def test_dumper
+    dumper = Ox::Dumper.new(:indent => 1, :circular => true)
+    small = { 'a' => [1, 2.5, 'three'], :b => nil }
+    big = (1..20000).map { |i| "item #{i} & more" }
+    [small, big, small, big, big].each do |obj|
+      assert_equal(Ox.dump(obj, :indent => 1, :circular => true), dumper.dump(obj))
+    end
+    w = ChunkWriter.new()
+    2.times do
+      assert_equal(nil, dumper.dump(big, w))
+    end
+    xml = Ox.dump(big, :indent => 1, :circular => true)
+    assert_equal(xml * 2, w.chunks.join(''))
+    assert_equal(small, Ox.load(dumper.dump(small), :mode => :object))
+  end
+
+  def test_to_file
+    obj = (1..20000).map { |i| Bag.new(:@name => "bag #{i}", :@num => i) }
+    filename = 'to_file_test.xml'
+    Ox.to_file(filename, obj, :indent => 2)
+    assert_equal(Ox.dump(obj, :indent => 2), File.read(filename))
+    File.open(filename, 'w') { |f| Ox.dump(obj, f, :indent => 0) }
+    assert_equal(obj, Ox.load_file(filename, :mode => :object))
+  ensure
+    File.delete(filename) if File.exist?(filename)
+  end
+
   def test_generic_encoding
     if RUBY_VERSION.start_with?('1.8')
       assert(true)